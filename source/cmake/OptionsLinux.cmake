@@ -19,6 +19,7 @@ find_package(LibDRM 2.4.0 REQUIRED)
 find_package(LibUDEV 200 REQUIRED)
 find_package(MiniGUI 5.0.14 REQUIRED)
 find_package(LibRGA 1.9.0)
+find_package(Threads REQUIRED)
 
 if (LibDRM_FOUND)
 
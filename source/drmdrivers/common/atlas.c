@@ -0,0 +1,219 @@
+/*
+** atlas.c: The suballocator for small surfaces.
+**
+** Copyright (C) 2023 FMSoft (http://www.fmsoft.cn).
+** All Rights Reserved.
+**
+** Permission is hereby granted, free of charge, to any person obtaining a
+** copy of this software and associated documentation files (the
+** "Software"), to deal in the Software without restriction, including
+** without limitation the rights to use, copy, modify, merge, publish,
+** distribute, sub license, and/or sell copies of the Software, and to
+** permit persons to whom the Software is furnished to do so, subject to
+** the following conditions:
+**
+** The above copyright notice and this permission notice (including the
+** next paragraph) shall be included in all copies or substantial portions
+** of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+** OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+** MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+** IN NO EVENT SHALL VMWARE AND/OR ITS SUPPLIERS BE LIABLE FOR
+** ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+** TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+** SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <minigui/common.h>
+#include <minigui/minigui.h>
+#include <minigui/gdi.h>
+#include <minigui/exstubs.h>
+
+#include "atlas.h"
+
+struct _DrmAtlasPage {
+    DrmAtlasPage *next;
+    DrmSurfaceBuffer *buf;
+
+    uint32_t drm_format;
+    uint32_t slot_size;
+    unsigned nr_slots;
+    unsigned nr_used;
+
+    /* one bit for every slot in use */
+    uint64_t bitmap[ATLAS_MAX_SLOTS / 64];
+};
+
+struct _DrmAtlas {
+    DrmDriver *drv;
+    const DrmAtlasOps *ops;
+    DrmAtlasPage *pages;
+    unsigned nr_pages;
+};
+
+DrmAtlas *drm_atlas_new(DrmDriver *drv, const DrmAtlasOps *ops)
+{
+    DrmAtlas *atlas;
+    const char *env = getenv("HBDDRM_ATLAS");
+
+    if (env && strcmp(env, "0") == 0) {
+        _MG_PRINTF("DRM>ATLAS: suballocation of small surfaces disabled\n");
+        return NULL;
+    }
+
+    atlas = calloc(1, sizeof(*atlas));
+    if (atlas == NULL) {
+        _ERR_PRINTF("DRM>ATLAS: failed to allocate atlas: %m\n");
+        return NULL;
+    }
+
+    atlas->drv = drv;
+    atlas->ops = ops;
+    return atlas;
+}
+
+void drm_atlas_delete(DrmAtlas *atlas)
+{
+    DrmAtlasPage *page, *next;
+
+    if (atlas == NULL)
+        return;
+
+    for (page = atlas->pages; page; page = next) {
+        next = page->next;
+        if (page->nr_used) {
+            _WRN_PRINTF("DRM>ATLAS: there are still %u slots used in page %p\n",
+                    page->nr_used, page);
+        }
+
+        atlas->ops->destroy_page(atlas->drv, page->buf);
+        free(page);
+    }
+
+    free(atlas);
+}
+
+static uint32_t slot_size_for(uint32_t width, uint32_t height)
+{
+    uint32_t size = ATLAS_MIN_SLOT_SIZE;
+    uint32_t max = MAX(width, height);
+
+    while (size < max)
+        size <<= 1;
+
+    return size;
+}
+
+static DrmAtlasPage *new_page(DrmAtlas *atlas,
+        uint32_t drm_format, uint32_t slot_size)
+{
+    DrmAtlasPage *page;
+    unsigned nr_slots_per_line = ATLAS_PAGE_SIZE / slot_size;
+
+    page = calloc(1, sizeof(*page));
+    if (page == NULL)
+        return NULL;
+
+    page->buf = atlas->ops->create_page(atlas->drv, drm_format,
+            ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE);
+    if (page->buf == NULL) {
+        free(page);
+        return NULL;
+    }
+
+    page->drm_format = drm_format;
+    page->slot_size = slot_size;
+    page->nr_slots = nr_slots_per_line * nr_slots_per_line;
+
+    page->next = atlas->pages;
+    atlas->pages = page;
+    atlas->nr_pages++;
+
+    _DBG_PRINTF("DRM>ATLAS: new page %p for slots of %u pixels (total %u)\n",
+            page, slot_size, atlas->nr_pages);
+    return page;
+}
+
+static void delete_page(DrmAtlas *atlas, DrmAtlasPage *page)
+{
+    DrmAtlasPage **prev;
+
+    for (prev = &atlas->pages; *prev; prev = &(*prev)->next) {
+        if (*prev == page) {
+            *prev = page->next;
+            break;
+        }
+    }
+
+    atlas->ops->destroy_page(atlas->drv, page->buf);
+    atlas->nr_pages--;
+    free(page);
+}
+
+int drm_atlas_alloc(DrmAtlas *atlas, uint32_t drm_format,
+        uint32_t width, uint32_t height, DrmAtlasSlot *slot)
+{
+    DrmAtlasPage *page;
+    uint32_t slot_size = slot_size_for(width, height);
+    unsigned i, index;
+
+    if (slot_size > ATLAS_MAX_SLOT_SIZE)
+        return -1;
+
+    for (page = atlas->pages; page; page = page->next) {
+        if (page->drm_format == drm_format && page->slot_size == slot_size &&
+                page->nr_used < page->nr_slots)
+            break;
+    }
+
+    if (page == NULL && (page = new_page(atlas, drm_format, slot_size)) == NULL)
+        return -1;
+
+    for (i = 0; i < TABLESIZE(page->bitmap); i++) {
+        if (~page->bitmap[i])
+            break;
+    }
+
+    index = i * 64 + __builtin_ctzll(~page->bitmap[i]);
+    assert(index < page->nr_slots);
+
+    page->bitmap[i] |= 1ULL << (index % 64);
+    page->nr_used++;
+
+    slot->page = page;
+    slot->page_buf = page->buf;
+    slot->index = index;
+    slot->x = (index % (ATLAS_PAGE_SIZE / slot_size)) * slot_size;
+    slot->y = (index / (ATLAS_PAGE_SIZE / slot_size)) * slot_size;
+    return 0;
+}
+
+void drm_atlas_free(DrmAtlas *atlas, DrmAtlasSlot *slot)
+{
+    DrmAtlasPage *page = slot->page, *other;
+
+    assert(page->bitmap[slot->index / 64] & (1ULL << (slot->index % 64)));
+    page->bitmap[slot->index / 64] &= ~(1ULL << (slot->index % 64));
+    page->nr_used--;
+    slot->page = NULL;
+
+    if (page->nr_used)
+        return;
+
+    /* Keep one page with free slots around for every slot size. */
+    for (other = atlas->pages; other; other = other->next) {
+        if (other != page && other->drm_format == page->drm_format &&
+                other->slot_size == page->slot_size &&
+                other->nr_used < other->nr_slots) {
+            delete_page(atlas, page);
+            break;
+        }
+    }
+}
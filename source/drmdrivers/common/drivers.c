@@ -34,12 +34,135 @@
 #include <string.h>
 #include <time.h>
 
+#include <drm_fourcc.h>
+
 #include <minigui/common.h>
 #include <minigui/minigui.h>
 #include <minigui/gdi.h>
 #include <minigui/exstubs.h>
 
+#include "libdrm-macros.h"
+#include "helpers.h"
 #include "drivers.h"
+#include "hbddrmdrivers.h"
+
+static struct registered_driver {
+    DrmDriver *drv;
+    int dev_fd;
+    const DrmDriverExtOps *ops;
+    uint32_t clear_pixel;
+    bool clear_always;
+} registered_drivers[DRM_MAX_DRIVERS];
+
+void drm_driver_register(DrmDriver *drv, int dev_fd,
+        const DrmDriverExtOps *ops)
+{
+    int i;
+
+    for (i = 0; i < DRM_MAX_DRIVERS; i++) {
+        if (registered_drivers[i].drv == NULL) {
+            registered_drivers[i].drv = drv;
+            registered_drivers[i].dev_fd = dev_fd;
+            registered_drivers[i].ops = ops;
+            registered_drivers[i].clear_pixel = 0;
+            registered_drivers[i].clear_always = false;
+            return;
+        }
+    }
+
+    _WRN_PRINTF("Too many drivers; the extra interfaces are not available "
+            "for the driver on device %d\n", dev_fd);
+}
+
+void drm_driver_unregister(DrmDriver *drv)
+{
+    int i;
+
+    for (i = 0; i < DRM_MAX_DRIVERS; i++) {
+        if (registered_drivers[i].drv == drv) {
+            registered_drivers[i].drv = NULL;
+            registered_drivers[i].ops = NULL;
+            return;
+        }
+    }
+}
+
+static struct registered_driver *find_driver(DrmDriver *drv)
+{
+    int i;
+
+    for (i = 0; drv && i < DRM_MAX_DRIVERS; i++) {
+        if (registered_drivers[i].drv == drv)
+            return registered_drivers + i;
+    }
+
+    return NULL;
+}
+
+static const DrmDriverExtOps *get_ext_ops(DrmDriver *drv)
+{
+    struct registered_driver *rd = find_driver(drv);
+    return rd ? rd->ops : NULL;
+}
+
+bool drm_driver_clear_on_create(DrmDriver *drv, uint32_t flags,
+        uint32_t *pixel)
+{
+    struct registered_driver *rd = find_driver(drv);
+
+    if (rd == NULL) {
+        *pixel = 0;
+        return (flags & HBDDRM_SURBUF_FLAG_CLEAR) != 0;
+    }
+
+    *pixel = rd->clear_pixel;
+    return rd->clear_always || (flags & HBDDRM_SURBUF_FLAG_CLEAR);
+}
+
+DrmDriver *hbddrm_get_driver(int dev_fd)
+{
+    int i;
+
+    for (i = 0; i < DRM_MAX_DRIVERS; i++) {
+        if (registered_drivers[i].drv &&
+                (dev_fd < 0 || registered_drivers[i].dev_fd == dev_fd))
+            return registered_drivers[i].drv;
+    }
+
+    return NULL;
+}
+
+int hbddrm_set_clear_pixel(DrmDriver *drv, uint32_t pixel, int always)
+{
+    struct registered_driver *rd = find_driver(drv);
+
+    if (rd == NULL)
+        return -1;
+
+    rd->clear_pixel = pixel;
+    rd->clear_always = always != 0;
+    return 0;
+}
+
+int hbddrm_dump_stats(DrmDriver *drv, FILE *fp)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->dump_stats == NULL)
+        return -1;
+
+    return ops->dump_stats(drv, fp);
+}
+
+int hbddrm_get_hw_stats(DrmDriver *drv, HbdDrmHwStats *stats, int reset)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->get_hw_stats == NULL || stats == NULL)
+        return -1;
+
+    return ops->get_hw_stats(drv, stats, reset != 0);
+}
 
 extern DrmDriverOps* __drm_ex_driver_get(const char* driver_name, int dev_fd,
         int* version)
@@ -68,3 +191,243 @@ extern DrmDriverOps* __drm_ex_driver_get(const char* driver_name, int dev_fd,
     return NULL;
 }
 
+
+int hbddrm_trim_buffer_pool(DrmDriver *drv, size_t keep)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->trim_pool == NULL)
+        return -1;
+
+    return ops->trim_pool(drv, keep);
+}
+
+int hbddrm_set_color_space(DrmDriver *drv, DrmSurfaceBuffer *buf,
+        int color_space)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->set_color_space == NULL)
+        return -1;
+
+    return ops->set_color_space(drv, buf, color_space);
+}
+
+int hbddrm_get_buffer_modifier(DrmDriver *drv, DrmSurfaceBuffer *buf,
+        uint64_t *modifier)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->get_modifier == NULL)
+        return -1;
+
+    return ops->get_modifier(drv, buf, modifier);
+}
+
+static inline bool rect_in_buffer(const DrmSurfaceBuffer *buf,
+        int x, int y, int width, int height)
+{
+    return x >= 0 && y >= 0 && x + width <= (int)buf->width &&
+        y + height <= (int)buf->height;
+}
+
+int hbddrm_composite(DrmDriver *drv,
+        DrmSurfaceBuffer *src, int src_x, int src_y,
+        DrmSurfaceBuffer *bg, int bg_x, int bg_y,
+        DrmSurfaceBuffer *dst, int dst_x, int dst_y,
+        int width, int height, int blend, int alpha)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+    GAL_Rect src_rc = { src_x, src_y, width, height };
+    GAL_Rect bg_rc = { bg_x, bg_y, width, height };
+    GAL_Rect dst_rc = { dst_x, dst_y, width, height };
+
+    if (ops == NULL || ops->composite == NULL)
+        return -1;
+
+    if (width <= 0 || height <= 0 ||
+            !rect_in_buffer(src, src_x, src_y, width, height) ||
+            !rect_in_buffer(bg, bg_x, bg_y, width, height) ||
+            !rect_in_buffer(dst, dst_x, dst_y, width, height))
+        return -1;
+
+    return ops->composite(drv, src, &src_rc, bg, &bg_rc, dst, &dst_rc,
+            blend, alpha);
+}
+
+int hbddrm_fill_rects(DrmDriver *drv, DrmSurfaceBuffer *buf,
+        const HbdDrmRect *rects, int nr_rects, uint32_t pixel)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    STATIC_ASSERT(sizeof(HbdDrmRect) == sizeof(GAL_Rect));
+
+    if (ops == NULL || ops->fill_rects == NULL)
+        return -1;
+
+    if (nr_rects <= 0)
+        return 0;
+
+    return ops->fill_rects(drv, buf, (const GAL_Rect *)rects, nr_rects, pixel);
+}
+
+int hbddrm_draw_rects(DrmDriver *drv, DrmSurfaceBuffer *buf,
+        const HbdDrmRect *rects, int nr_rects, uint32_t pixel, int thickness)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->draw_rects == NULL || thickness <= 0)
+        return -1;
+
+    if (nr_rects <= 0)
+        return 0;
+
+    return ops->draw_rects(drv, buf, (const GAL_Rect *)rects, nr_rects,
+            pixel, thickness);
+}
+
+DrmSurfaceBuffer *hbddrm_create_buffer_from_vaddr(DrmDriver *drv,
+        void *vaddr, size_t size, uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t pitch)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->create_buffer_from_vaddr == NULL || vaddr == NULL)
+        return NULL;
+
+    return ops->create_buffer_from_vaddr(drv, vaddr, size, drm_format,
+            hdr_size, width, height, pitch);
+}
+
+int hbddrm_destroy_buffer(DrmDriver *drv, DrmSurfaceBuffer *buf)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->destroy_buffer == NULL)
+        return -1;
+
+    ops->destroy_buffer(drv, buf);
+    return 0;
+}
+
+int hbddrm_sync_buffer(DrmDriver *drv, DrmSurfaceBuffer *buf)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->sync_buffer == NULL)
+        return -1;
+
+    ops->sync_buffer(drv, buf);
+    return 0;
+}
+
+int hbddrm_present_rotated(DrmDriver *drv,
+        DrmSurfaceBuffer *shadow, DrmSurfaceBuffer *scanout,
+        const HbdDrmRect *rects, int nr_rects, int rotation)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+
+    if (ops == NULL || ops->present_rotated == NULL)
+        return -1;
+
+    if (nr_rects <= 0)
+        return 0;
+
+    return ops->present_rotated(drv, shadow, scanout,
+            (const GAL_Rect *)rects, nr_rects, rotation);
+}
+
+/* The bits to set for an opaque pixel of a 32-bit format, or 0. */
+static uint32_t opaque_bits(uint32_t drm_format)
+{
+    switch (drm_format) {
+        case DRM_FORMAT_XRGB8888:
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_ARGB8888:
+        case DRM_FORMAT_ABGR8888:
+            return 0xFF000000;
+
+        case DRM_FORMAT_RGBX8888:
+        case DRM_FORMAT_BGRX8888:
+        case DRM_FORMAT_RGBA8888:
+        case DRM_FORMAT_BGRA8888:
+            return 0x000000FF;
+    }
+
+    return 0;
+}
+
+/* Get the pixel at (x, y) of a surface for the CPU; the surface is mapped
+   if it is not mapped already, else its hardware operations are waited for. */
+static uint8_t *begin_cpu_access(DrmDriver *drv, const DrmDriverExtOps *ops,
+        DrmSurfaceBuffer *buf, int x, int y, bool *mapped)
+{
+    *mapped = false;
+    if (buf->buff == NULL) {
+        if (ops->map_buffer(drv, buf) == NULL)
+            return NULL;
+        *mapped = true;
+    }
+    else if (ops->sync_buffer) {
+        ops->sync_buffer(drv, buf);
+    }
+
+    return buf->buff + buf->offset + y * buf->pitch + x * buf->cpp;
+}
+
+int hbddrm_mask_blit(DrmDriver *drv,
+        DrmSurfaceBuffer *src, int src_x, int src_y, uint32_t pixel,
+        const uint8_t *mask, int mask_pitch,
+        DrmSurfaceBuffer *dst, int dst_x, int dst_y,
+        int width, int height)
+{
+    const DrmDriverExtOps *ops = get_ext_ops(drv);
+    GAL_Rect src_rc = { src_x, src_y, width, height };
+    GAL_Rect dst_rc = { dst_x, dst_y, width, height };
+    uint8_t *src_bits = NULL, *dst_bits;
+    bool src_mapped = false, dst_mapped;
+
+    if (ops == NULL || mask == NULL || mask_pitch < width)
+        return -1;
+
+    if (width <= 0 || height <= 0)
+        return 0;
+
+    if (!rect_in_buffer(dst, dst_x, dst_y, width, height) ||
+            (src && !rect_in_buffer(src, src_x, src_y, width, height)))
+        return -1;
+
+    if (ops->mask_blit && ops->mask_blit(drv, src, &src_rc, pixel,
+                mask, mask_pitch, dst, &dst_rc) == 0)
+        return 0;
+
+    if (ops->map_buffer == NULL || ops->unmap_buffer == NULL ||
+            dst->cpp != 4 || (src && src->drm_format != dst->drm_format))
+        return -1;
+
+    dst_bits = begin_cpu_access(drv, ops, dst, dst_x, dst_y, &dst_mapped);
+    if (dst_bits == NULL)
+        return -1;
+
+    if (src == dst) {
+        src_bits = dst->buff + dst->offset + src_y * dst->pitch + src_x * 4;
+    }
+    else if (src) {
+        src_bits = begin_cpu_access(drv, ops, src, src_x, src_y, &src_mapped);
+        if (src_bits == NULL) {
+            if (dst_mapped)
+                ops->unmap_buffer(drv, dst);
+            return -1;
+        }
+    }
+
+    drm_mask_blend_pixels(dst_bits, dst->pitch, src_bits,
+            src ? src->pitch : 0, pixel, opaque_bits(dst->drm_format),
+            mask, mask_pitch, width, height);
+
+    if (src_mapped)
+        ops->unmap_buffer(drv, src);
+    if (dst_mapped)
+        ops->unmap_buffer(drv, dst);
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+** executor.c: The asynchronous submission thread of a driver.
+**
+** Copyright (C) 2023 FMSoft (http://www.fmsoft.cn).
+** All Rights Reserved.
+**
+** Permission is hereby granted, free of charge, to any person obtaining a
+** copy of this software and associated documentation files (the
+** "Software"), to deal in the Software without restriction, including
+** without limitation the rights to use, copy, modify, merge, publish,
+** distribute, sub license, and/or sell copies of the Software, and to
+** permit persons to whom the Software is furnished to do so, subject to
+** the following conditions:
+**
+** The above copyright notice and this permission notice (including the
+** next paragraph) shall be included in all copies or substantial portions
+** of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+** OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+** MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+** IN NO EVENT SHALL VMWARE AND/OR ITS SUPPLIERS BE LIABLE FOR
+** ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+** TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+** SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <minigui/common.h>
+#include <minigui/minigui.h>
+#include <minigui/gdi.h>
+#include <minigui/exstubs.h>
+
+#include "executor.h"
+
+typedef struct _DrmExecJob {
+    CB_DRM_EXEC_JOB run;
+    uint64_t data[DRM_EXECUTOR_MAX_DATA / sizeof(uint64_t)];
+} DrmExecJob;
+
+struct _DrmExecutor {
+    DrmDriver *drv;
+    pthread_t thread;
+
+    /* Posted once for every job queued, and once to stop the thread. */
+    sem_t nr_queued;
+
+    /* The sequence number of the last job queued; written by the producer. */
+    _Atomic uint64_t head;
+    /* The sequence number of the last job done; written by the consumer. */
+    _Atomic uint64_t tail;
+
+    /* Only used to sleep while waiting for the consumer. */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    atomic_bool waiting;
+    atomic_bool quit;
+
+    DrmExecJob jobs[DRM_EXECUTOR_NR_JOBS];
+};
+
+static void *executor_thread(void *arg)
+{
+    DrmExecutor *exec = arg;
+
+    while (true) {
+        uint64_t seqno;
+        DrmExecJob *job;
+
+        while (sem_wait(&exec->nr_queued))
+            ;
+
+        seqno = atomic_load_explicit(&exec->tail, memory_order_relaxed) + 1;
+        if (seqno > atomic_load_explicit(&exec->head, memory_order_acquire)) {
+            if (atomic_load(&exec->quit))
+                break;
+            continue;
+        }
+
+        job = exec->jobs + (seqno % DRM_EXECUTOR_NR_JOBS);
+        job->run(exec->drv, job->data);
+
+        atomic_store(&exec->tail, seqno);
+        if (atomic_load(&exec->waiting)) {
+            pthread_mutex_lock(&exec->lock);
+            pthread_cond_broadcast(&exec->done);
+            pthread_mutex_unlock(&exec->lock);
+        }
+    }
+
+    return NULL;
+}
+
+DrmExecutor *drm_executor_new(DrmDriver *drv)
+{
+    DrmExecutor *exec;
+    const char *env = getenv("HBDDRM_ASYNC_SUBMIT");
+
+    if (env == NULL || strcmp(env, "1"))
+        return NULL;
+
+    exec = calloc(1, sizeof(*exec));
+    if (exec == NULL) {
+        _ERR_PRINTF("DRM>EXECUTOR: failed to allocate executor: %m\n");
+        return NULL;
+    }
+
+    exec->drv = drv;
+    sem_init(&exec->nr_queued, 0, 0);
+    pthread_mutex_init(&exec->lock, NULL);
+    pthread_cond_init(&exec->done, NULL);
+
+    if (pthread_create(&exec->thread, NULL, executor_thread, exec)) {
+        _ERR_PRINTF("DRM>EXECUTOR: failed to create thread: %m\n");
+        goto failed;
+    }
+
+    _MG_PRINTF("DRM>EXECUTOR: kernel submissions are asynchronous\n");
+    return exec;
+
+failed:
+    pthread_cond_destroy(&exec->done);
+    pthread_mutex_destroy(&exec->lock);
+    sem_destroy(&exec->nr_queued);
+    free(exec);
+    return NULL;
+}
+
+void drm_executor_delete(DrmExecutor *exec)
+{
+    if (exec == NULL)
+        return;
+
+    drm_executor_drain(exec);
+
+    atomic_store(&exec->quit, true);
+    sem_post(&exec->nr_queued);
+    pthread_join(exec->thread, NULL);
+
+    pthread_cond_destroy(&exec->done);
+    pthread_mutex_destroy(&exec->lock);
+    sem_destroy(&exec->nr_queued);
+    free(exec);
+}
+
+uint64_t drm_executor_submit(DrmExecutor *exec, CB_DRM_EXEC_JOB run,
+        const void *data, size_t size)
+{
+    uint64_t seqno = atomic_load_explicit(&exec->head,
+            memory_order_relaxed) + 1;
+    DrmExecJob *job;
+
+    assert(size <= DRM_EXECUTOR_MAX_DATA);
+
+    /* Wait for the slot if the queue is full. */
+    if (seqno > DRM_EXECUTOR_NR_JOBS)
+        drm_executor_wait(exec, seqno - DRM_EXECUTOR_NR_JOBS);
+
+    job = exec->jobs + (seqno % DRM_EXECUTOR_NR_JOBS);
+    job->run = run;
+    memcpy(job->data, data, size);
+
+    atomic_store_explicit(&exec->head, seqno, memory_order_release);
+    sem_post(&exec->nr_queued);
+    return seqno;
+}
+
+uint64_t drm_executor_last_seqno(DrmExecutor *exec)
+{
+    return atomic_load_explicit(&exec->head, memory_order_relaxed);
+}
+
+void drm_executor_wait(DrmExecutor *exec, uint64_t seqno)
+{
+    if (atomic_load(&exec->tail) >= seqno)
+        return;
+
+    pthread_mutex_lock(&exec->lock);
+    atomic_store(&exec->waiting, true);
+    while (atomic_load(&exec->tail) < seqno)
+        pthread_cond_wait(&exec->done, &exec->lock);
+    atomic_store(&exec->waiting, false);
+    pthread_mutex_unlock(&exec->lock);
+}
+
+void drm_executor_drain(DrmExecutor *exec)
+{
+    drm_executor_wait(exec, drm_executor_last_seqno(exec));
+}
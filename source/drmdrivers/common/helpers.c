@@ -51,6 +51,14 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "helpers.h"
+
 #define ROUND_TO_MULTIPLE(n, m) (((n) + (((m) - 1))) & ~((m) - 1))
 
 int drm_format_to_bpp(uint32_t drm_format, int* bpp, int* cpp)
@@ -112,3 +120,206 @@ int drm_format_to_bpp(uint32_t drm_format, int* bpp, int* cpp)
     return 1;
 }
 
+
+static void fill_row(uint8_t *dst, int cpp, uint32_t width, uint32_t pixel)
+{
+    uint32_t i;
+
+    switch (cpp) {
+        case 1:
+            memset(dst, (int)pixel, width);
+            break;
+
+        case 2:
+            for (i = 0; i < width; i++)
+                ((uint16_t *)dst)[i] = (uint16_t)pixel;
+            break;
+
+        case 3:
+            for (i = 0; i < width; i++, dst += 3) {
+                dst[0] = (uint8_t)pixel;
+                dst[1] = (uint8_t)(pixel >> 8);
+                dst[2] = (uint8_t)(pixel >> 16);
+            }
+            break;
+
+        default:
+            for (i = 0; i < width; i++)
+                ((uint32_t *)dst)[i] = pixel;
+            break;
+    }
+}
+
+void drm_fill_pixels(uint8_t *bits, uint32_t pitch, int cpp,
+        uint32_t width, uint32_t height, uint32_t pixel)
+{
+    uint32_t y;
+
+#ifdef __SSE2__
+    if (cpp == 1 || cpp == 2 || cpp == 4) {
+        __m128i value;
+
+        if (cpp == 1)
+            value = _mm_set1_epi8((char)pixel);
+        else if (cpp == 2)
+            value = _mm_set1_epi16((short)pixel);
+        else
+            value = _mm_set1_epi32((int)pixel);
+
+        for (y = 0; y < height; y++) {
+            uint8_t *dst = bits + y * pitch;
+            uint8_t *end = dst + width * cpp;
+            uint32_t head;
+
+            /* All pixels are the same, so the pattern needs no rotation
+               as long as the row starts at a pixel boundary. */
+            head = (uint32_t)((16 - ((uintptr_t)dst & 15)) & 15) / cpp;
+            if (head > width)
+                head = width;
+            fill_row(dst, cpp, head, pixel);
+            dst += head * cpp;
+
+            if (((uintptr_t)dst & 15) == 0) {
+                for (; dst + 64 <= end; dst += 64) {
+                    _mm_stream_si128((__m128i *)dst, value);
+                    _mm_stream_si128((__m128i *)(dst + 16), value);
+                    _mm_stream_si128((__m128i *)(dst + 32), value);
+                    _mm_stream_si128((__m128i *)(dst + 48), value);
+                }
+                for (; dst + 16 <= end; dst += 16)
+                    _mm_stream_si128((__m128i *)dst, value);
+            }
+
+            fill_row(dst, cpp, (uint32_t)(end - dst) / cpp, pixel);
+        }
+
+        _mm_sfence();
+        return;
+    }
+#endif
+
+    for (y = 0; y < height; y++)
+        fill_row(bits + y * pitch, cpp, width, pixel);
+}
+
+static inline uint32_t blend_pixel(uint32_t s, uint32_t d, uint32_t m)
+{
+    uint32_t r = 0, t;
+    int shift;
+
+    for (shift = 0; shift < 32; shift += 8) {
+        t = ((s >> shift) & 0xFF) * m + ((d >> shift) & 0xFF) * (255 - m) + 128;
+        r |= ((t + (t >> 8)) >> 8) << shift;
+    }
+
+    return r;
+}
+
+static void blend_row(uint32_t *dst, const uint32_t *src, uint32_t pixel,
+        uint32_t opaque, const uint8_t *mask, uint32_t width)
+{
+    uint32_t x;
+
+    for (x = 0; x < width; x++) {
+        uint32_t s = (src ? src[x] : pixel) | opaque;
+
+        if (mask[x] == 0xFF)
+            dst[x] = s;
+        else if (mask[x])
+            dst[x] = blend_pixel(s, dst[x], mask[x]);
+    }
+}
+
+/*
+ * Four pixels are done at a time with SIMD: the coverage of every pixel is
+ * spread over its four channels, and the channels are widened to 16 bits,
+ * where (s * m + d * (255 - m) + 128) does not overflow. A run of four
+ * pixels fully uncovered or fully covered is skipped or copied, which is
+ * most of the pixels of a glyph.
+ */
+void drm_mask_blend_pixels(uint8_t *dst, uint32_t dst_pitch,
+        const uint8_t *src, uint32_t src_pitch, uint32_t pixel,
+        uint32_t opaque, const uint8_t *mask, uint32_t mask_pitch,
+        uint32_t width, uint32_t height)
+{
+    uint32_t x, y;
+
+    pixel |= opaque;
+    for (y = 0; y < height; y++) {
+        uint32_t *d = (uint32_t *)(dst + y * dst_pitch);
+        const uint32_t *s = src ? (const uint32_t *)(src + y * src_pitch) :
+            NULL;
+        const uint8_t *m = mask + y * mask_pitch;
+
+        x = 0;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+        for (; x + 4 <= width; x += 4) {
+            uint32_t m4, colors[4];
+
+            memcpy(&m4, m + x, sizeof(m4));
+            if (m4 == 0)
+                continue;
+
+            if (s) {
+                colors[0] = s[x] | opaque;
+                colors[1] = s[x + 1] | opaque;
+                colors[2] = s[x + 2] | opaque;
+                colors[3] = s[x + 3] | opaque;
+            }
+            else {
+                colors[0] = colors[1] = colors[2] = colors[3] = pixel;
+            }
+
+            if (m4 == 0xFFFFFFFF) {
+                memcpy(d + x, colors, sizeof(colors));
+                continue;
+            }
+
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i bias = _mm_set1_epi16(128);
+            const __m128i full = _mm_set1_epi16(255);
+            __m128i mv = _mm_cvtsi32_si128((int)m4);
+            mv = _mm_unpacklo_epi8(mv, mv);
+            mv = _mm_unpacklo_epi16(mv, mv);
+
+            __m128i sv = _mm_loadu_si128((const __m128i *)colors);
+            __m128i dv = _mm_loadu_si128((const __m128i *)(d + x));
+            __m128i m_lo = _mm_unpacklo_epi8(mv, zero);
+            __m128i m_hi = _mm_unpackhi_epi8(mv, zero);
+
+            __m128i lo = _mm_add_epi16(
+                    _mm_mullo_epi16(_mm_unpacklo_epi8(sv, zero), m_lo),
+                    _mm_mullo_epi16(_mm_unpacklo_epi8(dv, zero),
+                        _mm_sub_epi16(full, m_lo)));
+            __m128i hi = _mm_add_epi16(
+                    _mm_mullo_epi16(_mm_unpackhi_epi8(sv, zero), m_hi),
+                    _mm_mullo_epi16(_mm_unpackhi_epi8(dv, zero),
+                        _mm_sub_epi16(full, m_hi)));
+            lo = _mm_add_epi16(lo, bias);
+            hi = _mm_add_epi16(hi, bias);
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+            _mm_storeu_si128((__m128i *)(d + x), _mm_packus_epi16(lo, hi));
+#else
+            uint8x8_t m8 = vreinterpret_u8_u32(vdup_n_u32(m4));
+            uint8x8x2_t m2 = vzip_u8(m8, m8);
+            uint8x8x2_t mm = vzip_u8(m2.val[0], m2.val[0]);
+
+            uint8x16_t sv = vld1q_u8((const uint8_t *)colors);
+            uint8x16_t dv = vld1q_u8((const uint8_t *)(d + x));
+
+            uint16x8_t lo = vmull_u8(vget_low_u8(sv), mm.val[0]);
+            uint16x8_t hi = vmull_u8(vget_high_u8(sv), mm.val[1]);
+            lo = vmlal_u8(lo, vget_low_u8(dv), vmvn_u8(mm.val[0]));
+            hi = vmlal_u8(hi, vget_high_u8(dv), vmvn_u8(mm.val[1]));
+            vst1q_u8((uint8_t *)(d + x),
+                    vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)),
+                        vraddhn_u16(hi, vrshrq_n_u16(hi, 8))));
+#endif
+        }
+#endif
+
+        blend_row(d + x, s ? s + x : NULL, pixel, opaque, m + x, width - x);
+    }
+}
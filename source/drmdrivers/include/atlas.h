@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2023 FMSoft.CN
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIBDRMDRIVERS_ATLAS_H
+#define LIBDRMDRIVERS_ATLAS_H
+
+#include "config.h"
+
+#include <stdbool.h>
+
+/*
+ * The atlas packs small off-screen surfaces into shared pages, so that they
+ * do not cost a kernel object each. A page is a normal surface buffer of the
+ * backend; a suballocated surface is a square slot of the page and shares
+ * its kernel object, addressed by its own offset.
+ */
+
+/* The width and the height of a page in pixels. */
+#define ATLAS_PAGE_SIZE         256
+
+/* The slot sizes; a surface takes the smallest slot it fits in. */
+#define ATLAS_MIN_SLOT_SIZE     16
+#define ATLAS_MAX_SLOT_SIZE     64
+
+#define ATLAS_MAX_SLOTS \
+    ((ATLAS_PAGE_SIZE / ATLAS_MIN_SLOT_SIZE) * \
+     (ATLAS_PAGE_SIZE / ATLAS_MIN_SLOT_SIZE))
+
+#define IS_SURFACE_FOR_ATLAS(hdr_size, width, height, flags)        \
+    ((hdr_size) == 0 &&                                             \
+     ((flags) & DRM_SURBUF_TYPE_MASK) == DRM_SURBUF_TYPE_OFFSCREEN && \
+     (width) <= ATLAS_MAX_SLOT_SIZE && (height) <= ATLAS_MAX_SLOT_SIZE)
+
+typedef struct _DrmAtlas DrmAtlas;
+typedef struct _DrmAtlasPage DrmAtlasPage;
+
+/* The place of a suballocated surface; page is NULL for other surfaces. */
+typedef struct _DrmAtlasSlot {
+    DrmAtlasPage *page;
+    DrmSurfaceBuffer *page_buf;
+    uint32_t x, y;
+    unsigned index;
+} DrmAtlasSlot;
+
+/* The backend operations to create and destroy the buffer of a page. */
+typedef struct _DrmAtlasOps {
+    DrmSurfaceBuffer *(*create_page)(DrmDriver *drv, uint32_t drm_format,
+            uint32_t width, uint32_t height);
+    void (*destroy_page)(DrmDriver *drv, DrmSurfaceBuffer *page_buf);
+} DrmAtlasOps;
+
+#ifdef __cplusplus
+extern "C" {
+#endif  /* __cplusplus */
+
+/* Returns NULL if the atlas is disabled by HBDDRM_ATLAS=0. */
+DrmAtlas *drm_atlas_new(DrmDriver *drv, const DrmAtlasOps *ops) WTF_INTERNAL;
+void drm_atlas_delete(DrmAtlas *atlas) WTF_INTERNAL;
+
+int drm_atlas_alloc(DrmAtlas *atlas, uint32_t drm_format,
+        uint32_t width, uint32_t height, DrmAtlasSlot *slot) WTF_INTERNAL;
+void drm_atlas_free(DrmAtlas *atlas, DrmAtlasSlot *slot) WTF_INTERNAL;
+
+#ifdef __cplusplus
+}
+#endif  /* __cplusplus */
+
+#endif /* LIBDRMDRIVERS_ATLAS_H */
@@ -41,10 +41,68 @@
 
 #include "config.h"
 
+#include <stdbool.h>
+#include <stdio.h>
+
+struct _HbdDrmHwStats;
+
+/* The operations behind the extra interfaces in hbddrmdrivers.h;
+   a driver leaves the ones it does not support NULL. */
+typedef struct _DrmDriverExtOps {
+    int (*dump_stats)(DrmDriver *drv, FILE *fp);
+    int (*get_hw_stats)(DrmDriver *drv, struct _HbdDrmHwStats *stats,
+            bool reset);
+    int (*trim_pool)(DrmDriver *drv, size_t keep);
+    int (*set_color_space)(DrmDriver *drv, DrmSurfaceBuffer *buf,
+            int color_space);
+    int (*get_modifier)(DrmDriver *drv, DrmSurfaceBuffer *buf,
+            uint64_t *modifier);
+    int (*composite)(DrmDriver *drv,
+            DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+            DrmSurfaceBuffer *bg_buf, const GAL_Rect *bg_rc,
+            DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+            int blend, int alpha);
+    int (*fill_rects)(DrmDriver *drv, DrmSurfaceBuffer *dst_buf,
+            const GAL_Rect *rcs, int nr_rcs, uint32_t pixel);
+    int (*draw_rects)(DrmDriver *drv, DrmSurfaceBuffer *dst_buf,
+            const GAL_Rect *rcs, int nr_rcs, uint32_t pixel, int thickness);
+    DrmSurfaceBuffer *(*create_buffer_from_vaddr)(DrmDriver *drv,
+            void *vaddr, size_t size, uint32_t drm_format, uint32_t hdr_size,
+            uint32_t width, uint32_t height, uint32_t pitch);
+    void (*destroy_buffer)(DrmDriver *drv, DrmSurfaceBuffer *buf);
+    void (*sync_buffer)(DrmDriver *drv, DrmSurfaceBuffer *buf);
+    int (*present_rotated)(DrmDriver *drv,
+            DrmSurfaceBuffer *shadow_buf, DrmSurfaceBuffer *scanout_buf,
+            const GAL_Rect *rcs, int nr_rcs, int rotation);
+    /* the hardware mask blit; returns -1 to leave it to the CPU */
+    int (*mask_blit)(DrmDriver *drv,
+            DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc, uint32_t pixel,
+            const uint8_t *mask, int mask_pitch,
+            DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc);
+    /* the ones of DrmDriverOps, for the CPU paths of the interfaces */
+    uint8_t *(*map_buffer)(DrmDriver *drv, DrmSurfaceBuffer *buf);
+    void (*unmap_buffer)(DrmDriver *drv, DrmSurfaceBuffer *buf);
+} DrmDriverExtOps;
+
+/* The maximal number of drivers living at the same time. */
+#define DRM_MAX_DRIVERS     4
+
 #ifdef __cplusplus
 extern "C" {
 #endif  /* __cplusplus */
 
+/* Registers a driver when it is created, for the extra interfaces. */
+void drm_driver_register(DrmDriver *drv, int dev_fd,
+        const DrmDriverExtOps *ops) WTF_INTERNAL;
+
+/* Unregisters a driver when it is destroyed. */
+void drm_driver_unregister(DrmDriver *drv) WTF_INTERNAL;
+
+/* Returns true if a surface created with the flags should be cleared,
+   and the pixel to clear it with. */
+bool drm_driver_clear_on_create(DrmDriver *drv, uint32_t flags,
+        uint32_t *pixel) WTF_INTERNAL;
+
 #if HAVE(HAVE_LIBRGA)
 DrmDriverOps* _drm_device_get_rockchip_driver(int devfd) WTF_INTERNAL;
 #endif
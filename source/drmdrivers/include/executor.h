@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2023 FMSoft.CN
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIBDRMDRIVERS_EXECUTOR_H
+#define LIBDRMDRIVERS_EXECUTOR_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The executor is an optional thread of a driver which makes the kernel
+ * submissions on behalf of the GUI thread. The GUI thread only records the
+ * operations in a lock-free single-producer queue; every job gets a sequence
+ * number, which the backend keeps in the buffers touched by the job, and
+ * waits for before the CPU accesses or releases such a buffer.
+ */
+
+/* The maximal size of the data of a job. */
+#define DRM_EXECUTOR_MAX_DATA   1024
+
+/* The number of jobs in the queue. */
+#define DRM_EXECUTOR_NR_JOBS    64
+
+typedef struct _DrmExecutor DrmExecutor;
+
+/* The callback to run a job in the executor thread. */
+typedef void (*CB_DRM_EXEC_JOB)(DrmDriver *drv, void *data);
+
+#ifdef __cplusplus
+extern "C" {
+#endif  /* __cplusplus */
+
+/* Returns NULL unless the executor is enabled by HBDDRM_ASYNC_SUBMIT=1. */
+DrmExecutor *drm_executor_new(DrmDriver *drv) WTF_INTERNAL;
+
+/* Runs all pending jobs and stops the thread. */
+void drm_executor_delete(DrmExecutor *exec) WTF_INTERNAL;
+
+/* Queues a job and returns its sequence number. The data is copied. */
+uint64_t drm_executor_submit(DrmExecutor *exec, CB_DRM_EXEC_JOB run,
+        const void *data, size_t size) WTF_INTERNAL;
+
+/* Returns the sequence number of the last job submitted. */
+uint64_t drm_executor_last_seqno(DrmExecutor *exec) WTF_INTERNAL;
+
+/* Waits for the job with the sequence number and all jobs before it. */
+void drm_executor_wait(DrmExecutor *exec, uint64_t seqno) WTF_INTERNAL;
+
+/* Waits for all jobs submitted. */
+void drm_executor_drain(DrmExecutor *exec) WTF_INTERNAL;
+
+#ifdef __cplusplus
+}
+#endif  /* __cplusplus */
+
+#endif /* LIBDRMDRIVERS_EXECUTOR_H */
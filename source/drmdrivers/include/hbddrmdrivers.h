@@ -0,0 +1,213 @@
+/*
+ * Copyright © 2023 FMSoft.CN
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HBDDRMDRIVERS_H
+#define HBDDRMDRIVERS_H
+
+/*
+ * The extra interfaces of the DRM drivers, which are not covered by the
+ * DrmDriverOps of MiniGUI. An application gets the driver created by the
+ * DRM engine of MiniGUI with hbddrm_get_driver(), then calls the functions
+ * below. A function returns -1 if the driver does not support it.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+/* The flag for create_buffer to clear a new surface with the pixel set by
+   hbddrm_set_clear_pixel(); the driver uses the hardware fill if it can. */
+#define HBDDRM_SURBUF_FLAG_CLEAR    0x00010000
+
+/* The flag for create_buffer to create a compressed (AFBC) scanout surface,
+   if the hardware can produce it; such a surface cannot be mapped, and is
+   only written by the hardware. Use hbddrm_get_buffer_modifier() to get
+   the modifier for drmModeAddFB2WithModifiers(). */
+#define HBDDRM_SURBUF_FLAG_AFBC     0x00020000
+
+/* The color spaces of a YUV surface, for the conversion to RGB; or'ed with
+   HBDDRM_COLOR_RANGE_FULL for the full range instead of the limited one. */
+#define HBDDRM_COLOR_SPACE_BT601    0x00
+#define HBDDRM_COLOR_SPACE_BT709    0x01
+#define HBDDRM_COLOR_RANGE_FULL     0x10
+
+/* The clockwise rotations of the scanout surface for
+   hbddrm_present_rotated(). */
+#define HBDDRM_ROTATE_90            1
+#define HBDDRM_ROTATE_180           2
+#define HBDDRM_ROTATE_270           3
+
+/* The operations counted by hbddrm_get_hw_stats(); a dithered copy counts
+   as a dither only. */
+#define HBDDRM_OP_FILL              0
+#define HBDDRM_OP_COPY              1
+#define HBDDRM_OP_SCALE             2
+#define HBDDRM_OP_ROTATE            3
+#define HBDDRM_OP_BLEND             4
+#define HBDDRM_OP_ROP               5
+#define HBDDRM_OP_COMPOSITE         6
+#define HBDDRM_OP_DITHER            7
+#define HBDDRM_NR_OPS               8
+
+/* The reasons an operation is left to the CPU. */
+#define HBDDRM_FALLBACK_FORMAT      0   /* a format or a layout */
+#define HBDDRM_FALLBACK_IMPORT      1   /* a surface cannot be imported */
+#define HBDDRM_FALLBACK_OPERATION   2   /* the hardware does not do it */
+#define HBDDRM_FALLBACK_CHECK       3   /* refused by the check */
+#define HBDDRM_NR_FALLBACKS         4
+
+/* The status codes of the check counted; for RGA, the index is the negated
+   IM_STATUS of librga (0 for IM_STATUS_FAILED, 1 for IM_STATUS_NOT_SUPPORTED,
+   and so on), and the last one takes the others. */
+#define HBDDRM_NR_CHECK_STATUS      8
+
+struct _DrmDriver;
+struct _DrmSurfaceBuffer;
+
+/* The counters of the 2D hardware of a driver. */
+typedef struct _HbdDrmHwStats {
+    /* the operations submitted to the hardware, by HBDDRM_OP_*; a blit split
+       into tiles counts for every tile */
+    uint64_t nr_ops[HBDDRM_NR_OPS];
+    /* the jobs submitted for them, and the bytes they read and write */
+    uint64_t nr_jobs;
+    uint64_t nr_bytes;
+    /* the jobs run synchronously, and the time they took */
+    uint64_t nr_timed_jobs;
+    uint64_t hw_time_ns;
+    /* the operations left to the CPU as refused by the check of the
+       hardware, by status */
+    uint64_t nr_rejects[HBDDRM_NR_CHECK_STATUS];
+    /* the operations left to the CPU, by HBDDRM_FALLBACK_* */
+    uint64_t nr_fallbacks[HBDDRM_NR_FALLBACKS];
+    /* the jobs the hardware failed to run */
+    uint64_t nr_failures;
+} HbdDrmHwStats;
+
+/* A rectangle; it has the layout of GAL_Rect of MiniGUI. */
+typedef struct _HbdDrmRect {
+    int x, y;
+    int w, h;
+} HbdDrmRect;
+
+#ifdef __cplusplus
+extern "C" {
+#endif  /* __cplusplus */
+
+/* Returns the driver created for the DRM device; the first one if dev_fd
+   is negative. Returns NULL if there is no such driver. */
+struct _DrmDriver *hbddrm_get_driver(int dev_fd);
+
+/* Sets the pixel to clear the new surfaces with. If always is not zero,
+   every new surface is cleared, as if created with HBDDRM_SURBUF_FLAG_CLEAR;
+   this is the way to go when the surfaces are created by MiniGUI. */
+int hbddrm_set_clear_pixel(struct _DrmDriver *drv, uint32_t pixel, int always);
+
+/* Releases the buffer objects kept by the driver for recycling, until
+   no more than keep bytes are left in the pool. */
+int hbddrm_trim_buffer_pool(struct _DrmDriver *drv, size_t keep);
+
+/* Dumps the statistics collected by the driver. A driver may collect them
+   only on demand, from the first call on. */
+int hbddrm_dump_stats(struct _DrmDriver *drv, FILE *fp);
+
+/* Gets the counters of the 2D hardware since the driver was created or
+   the counters were reset; resets them if reset is not zero. The jobs
+   queued are waited for first. */
+int hbddrm_get_hw_stats(struct _DrmDriver *drv, HbdDrmHwStats *stats,
+        int reset);
+
+/* Sets the color space of a YUV surface; the default is BT.601 with the
+   limited range. Returns -1 if the driver cannot convert from it. */
+int hbddrm_set_color_space(struct _DrmDriver *drv,
+        struct _DrmSurfaceBuffer *buf, int color_space);
+
+/* Gets the format modifier of a surface; DRM_FORMAT_MOD_LINEAR if it is
+   not compressed or tiled. */
+int hbddrm_get_buffer_modifier(struct _DrmDriver *drv,
+        struct _DrmSurfaceBuffer *buf, uint64_t *modifier);
+
+/* Composes a rectangle of src over a rectangle of the background bg into
+   a rectangle of dst in one pass, with a Porter-Duff operator of MiniGUI
+   (COLOR_BLEND_PD_*) and the global alpha of src (255 for none). The
+   rectangles are width x height; dst can be bg itself. */
+int hbddrm_composite(struct _DrmDriver *drv,
+        struct _DrmSurfaceBuffer *src, int src_x, int src_y,
+        struct _DrmSurfaceBuffer *bg, int bg_x, int bg_y,
+        struct _DrmSurfaceBuffer *dst, int dst_x, int dst_y,
+        int width, int height, int blend, int alpha);
+
+/* Fills the rectangles of a surface with the pixel, as one hardware job
+   if the driver can. Returns -1 without filling any rectangle if the
+   driver cannot fill one of them. */
+int hbddrm_fill_rects(struct _DrmDriver *drv, struct _DrmSurfaceBuffer *buf,
+        const HbdDrmRect *rects, int nr_rects, uint32_t pixel);
+
+/* Draws the outlines of the rectangles with the pixel; an outline has the
+   thickness in pixels, and is inside its rectangle. */
+int hbddrm_draw_rects(struct _DrmDriver *drv, struct _DrmSurfaceBuffer *buf,
+        const HbdDrmRect *rects, int nr_rects, uint32_t pixel, int thickness);
+
+/* Creates a surface on the memory of the application at vaddr, which the
+   hardware reads and writes without a copy. The layout is the one of the
+   surfaces created from a handle: the header of hdr_size bytes takes whole
+   lines of pitch, and the pixels follow; size can be 0. The memory must
+   live until the surface is destroyed with hbddrm_destroy_buffer(); call
+   hbddrm_sync_buffer() before touching it after a hardware operation. */
+struct _DrmSurfaceBuffer *hbddrm_create_buffer_from_vaddr(
+        struct _DrmDriver *drv, void *vaddr, size_t size,
+        uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t pitch);
+
+/* Destroys a surface created by hbddrm_create_buffer_from_vaddr(). */
+int hbddrm_destroy_buffer(struct _DrmDriver *drv,
+        struct _DrmSurfaceBuffer *buf);
+
+/* Waits for the hardware operations on a surface to finish. */
+int hbddrm_sync_buffer(struct _DrmDriver *drv, struct _DrmSurfaceBuffer *buf);
+
+/* Blends a color, or a rectangle of the surface src, into a rectangle of
+   dst through an 8-bit coverage mask of width x height, which has
+   mask_pitch bytes per row: every channel becomes src * m + dst * (1 - m),
+   with the alpha of the source taken as opaque. The pixel is in the format
+   of dst, and used only if src is NULL; src has the format of dst. The
+   hardware does it if it can, the CPU otherwise; both surfaces have 32-bit
+   pixels for the CPU. */
+int hbddrm_mask_blit(struct _DrmDriver *drv,
+        struct _DrmSurfaceBuffer *src, int src_x, int src_y, uint32_t pixel,
+        const uint8_t *mask, int mask_pitch,
+        struct _DrmSurfaceBuffer *dst, int dst_x, int dst_y,
+        int width, int height);
+
+/* Copies the dirty rectangles of the shadow surface to the scanout surface,
+   which is the shadow surface rotated by HBDDRM_ROTATE_*; the rectangles
+   are in the shadow surface. The rectangles are merged, and copied as one
+   hardware job if the driver can; the job is submitted before returning. */
+int hbddrm_present_rotated(struct _DrmDriver *drv,
+        struct _DrmSurfaceBuffer *shadow, struct _DrmSurfaceBuffer *scanout,
+        const HbdDrmRect *rects, int nr_rects, int rotation);
+
+#ifdef __cplusplus
+}
+#endif  /* __cplusplus */
+
+#endif /* HBDDRMDRIVERS_H */
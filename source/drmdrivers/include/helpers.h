@@ -34,6 +34,21 @@ extern "C" {
 
 int drm_format_to_bpp(uint32_t drm_format, int* bpp, int* cpp)  WTF_INTERNAL;
 
+/* Fills the pixels of a surface with the CPU. The stores bypass the cache
+   where the CPU has non-temporal stores, so that a large fresh buffer does
+   not evict the working set. */
+void drm_fill_pixels(uint8_t *bits, uint32_t pitch, int cpp,
+        uint32_t width, uint32_t height, uint32_t pixel) WTF_INTERNAL;
+
+/* Blends 32-bit pixels of src, or the pixel if src is NULL, into dst
+   through an 8-bit coverage mask: every channel becomes
+   (s * m + d * (255 - m)) / 255, rounded, and the bits of opaque are set in
+   the source pixels first, so that the alpha of the source is ignored. */
+void drm_mask_blend_pixels(uint8_t *dst, uint32_t dst_pitch,
+        const uint8_t *src, uint32_t src_pitch, uint32_t pixel,
+        uint32_t opaque, const uint8_t *mask, uint32_t mask_pitch,
+        uint32_t width, uint32_t height) WTF_INTERNAL;
+
 #ifdef __cplusplus
 }
 #endif  /* __cplusplus */
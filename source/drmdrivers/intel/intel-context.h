@@ -42,11 +42,15 @@
 
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <drm.h>
 #include <i915_drm.h>
 #include <libdrm/intel_bufmgr.h>
 #include "intel-chipset.h"
+#include "atlas.h"
+#include "executor.h"
+#include "intel-decode.h"
 
 #define DV_PF_555  (1<<8)
 #define DV_PF_565  (2<<8)
@@ -92,6 +96,13 @@ struct _DrmDriver {
     struct intel_batchbuffer batch;
     unsigned int maxBatchSize;
 
+    DrmAtlas *atlas;
+    DrmExecutor *executor;
+    /* libdrm does not lock the relocation trees: the executor thread holds
+       it to execute a batch, the GUI thread to emit or clear relocations */
+    pthread_mutex_t reloc_lock;
+    struct intel_cs_profiler profiler;
+
     int nr_buffers;
     int gen;
     uint32_t chip_id;
@@ -0,0 +1,258 @@
+/*
+ * Copyright © 2023 FMSoft.CN
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <minigui/common.h>
+#include <minigui/minigui.h>
+#include <minigui/gdi.h>
+#include <minigui/exstubs.h>
+
+#ifdef _MGGAL_DRM
+
+#ifdef HAVE_DRM_INTEL
+
+#include <drm.h>
+#include <i915_drm.h>
+
+#include "intel-reg.h"
+#include "intel-decode.h"
+
+static bool env_is_set(const char *name)
+{
+    const char *value = getenv(name);
+    return value && strcmp(value, "1") == 0;
+}
+
+void intel_cs_profiler_init(struct intel_cs_profiler *prof)
+{
+    memset(prof, 0, sizeof(*prof));
+    prof->decode = env_is_set("HBDDRM_I915_DECODE");
+    prof->dump_frames = env_is_set("HBDDRM_I915_STATS");
+    prof->enabled = prof->decode || prof->dump_frames;
+}
+
+static const char *ring_name(unsigned int ring)
+{
+    switch (ring & I915_EXEC_RING_MASK) {
+    case I915_EXEC_RENDER:
+        return "render";
+    case I915_EXEC_BLT:
+        return "blt";
+    default:
+        return "default";
+    }
+}
+
+static int cpp_from_br13(uint32_t br13)
+{
+    switch (br13 & (0x3 << 24)) {
+    case BR13_8:
+        return 1;
+    case BR13_565:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+/* The area of a blit given the top-left and bottom-right dwords. */
+static uint64_t blit_area(uint32_t tl, uint32_t br)
+{
+    int w = (int)(br & 0xffff) - (int)(tl & 0xffff);
+    int h = (int)(br >> 16) - (int)(tl >> 16);
+
+    return (w > 0 && h > 0) ? (uint64_t)w * h : 0;
+}
+
+/* Decodes one command; returns its length in dwords. */
+static unsigned int decode_command(struct intel_cs_profiler *prof,
+        const uint32_t *cmd, unsigned int left, unsigned int offset)
+{
+    struct intel_cs_stats *stats = &prof->frame;
+    const char *name = NULL;
+    unsigned int len = 1;
+    uint64_t bytes = 0;
+
+    switch (cmd[0] & (0x7 << 29)) {
+    case CMD_MI:
+        switch (cmd[0] & (0x3f << 23)) {
+        case MI_NOOP:
+            name = "MI_NOOP";
+            break;
+        case MI_BATCH_BUFFER_END:
+            name = "MI_BATCH_BUFFER_END";
+            break;
+        case MI_FLUSH:
+            name = "MI_FLUSH";
+            stats->flushes++;
+            break;
+        case MI_FLUSH_DW & (0x3f << 23):
+            name = "MI_FLUSH_DW";
+            len = (cmd[0] & 0x3f) + 2;
+            stats->flushes++;
+            break;
+        default:
+            name = "MI_UNKNOWN";
+            break;
+        }
+        break;
+
+    case CMD_2D:
+        len = (cmd[0] & 0xff) + 2;
+        switch (cmd[0] & (0x7f << 22)) {
+        case XY_COLOR_BLT_CMD & (0x7f << 22):
+            name = "XY_COLOR_BLT";
+            if (len >= 6 && left >= 6)
+                bytes = blit_area(cmd[2], cmd[3]) * cpp_from_br13(cmd[1]);
+            stats->blits++;
+            break;
+        case XY_SRC_COPY_BLT_CMD & (0x7f << 22):
+            name = "XY_SRC_COPY_BLT";
+            /* read from the source, write to the destination */
+            if (len >= 8 && left >= 8)
+                bytes = 2 * blit_area(cmd[2], cmd[3]) * cpp_from_br13(cmd[1]);
+            stats->blits++;
+            break;
+        case XY_SETUP_BLT_CMD & (0x7f << 22):
+            name = "XY_SETUP_BLT";
+            break;
+        case XY_TEXT_IMMEDIATE_BLIT_CMD & (0x7f << 22):
+            name = "XY_TEXT_IMMEDIATE_BLIT";
+            stats->blits++;
+            break;
+        default:
+            name = "2D_UNKNOWN";
+            break;
+        }
+        break;
+
+    case CMD_3D:
+        len = (cmd[0] & 0xff) + 2;
+        name = "3D";
+        break;
+
+    default:
+        name = "UNKNOWN";
+        break;
+    }
+
+    if (len > left)
+        len = left;
+    stats->bytes += bytes;
+
+    if (prof->decode) {
+        unsigned int i;
+
+        fprintf(stderr, "  0x%04x: %-24s (%u dwords)", offset * 4, name, len);
+        for (i = 0; i < len; i++)
+            fprintf(stderr, " %08x", cmd[i]);
+        fprintf(stderr, "\n");
+    }
+
+    return len;
+}
+
+void intel_cs_decode_batch(struct intel_cs_profiler *prof,
+        const uint32_t *map, unsigned int used, int nr_relocs,
+        unsigned int ring)
+{
+    unsigned int offset = 0;
+
+    if (prof->decode) {
+        fprintf(stderr, "DRM>i915: batch #%u on %s ring: "
+                "%u dwords, %d relocations\n",
+                prof->total.submits + prof->frame.submits,
+                ring_name(ring), used, nr_relocs);
+    }
+
+    prof->frame.submits++;
+    prof->frame.dwords += used;
+    if (nr_relocs > 0)
+        prof->frame.relocs += nr_relocs;
+
+    while (offset < used)
+        offset += decode_command(prof, map + offset, used - offset, offset);
+}
+
+static void add_stats(struct intel_cs_stats *to,
+        const struct intel_cs_stats *from)
+{
+    to->submits += from->submits;
+    to->dwords += from->dwords;
+    to->relocs += from->relocs;
+    to->blits += from->blits;
+    to->flushes += from->flushes;
+    to->bytes += from->bytes;
+}
+
+static void print_stats(FILE *fp, const char *title,
+        const struct intel_cs_stats *stats)
+{
+    fprintf(fp, "%s: submits %u, dwords %u, relocs %u, blits %u, "
+            "flushes %u, bytes %llu\n", title,
+            stats->submits, stats->dwords, stats->relocs, stats->blits,
+            stats->flushes, (unsigned long long)stats->bytes);
+}
+
+void intel_cs_end_frame(struct intel_cs_profiler *prof)
+{
+    if (prof->frame.submits == 0)
+        return;
+
+    if (prof->dump_frames) {
+        char title[32];
+
+        snprintf(title, sizeof(title), "DRM>i915: frame #%u",
+                prof->nr_frames);
+        print_stats(stderr, title, &prof->frame);
+    }
+
+    add_stats(&prof->total, &prof->frame);
+    memset(&prof->frame, 0, sizeof(prof->frame));
+    prof->nr_frames++;
+}
+
+void intel_cs_dump_stats(const struct intel_cs_profiler *prof, FILE *fp)
+{
+    struct intel_cs_stats total = prof->total;
+
+    add_stats(&total, &prof->frame);
+    fprintf(fp, "DRM>i915: %u frames\n", prof->nr_frames);
+    print_stats(fp, "DRM>i915: pending frame", &prof->frame);
+    print_stats(fp, "DRM>i915: total", &total);
+    if (prof->nr_frames) {
+        fprintf(fp, "DRM>i915: per frame: submits %.1f, dwords %.1f, "
+                "blits %.1f, bytes %.0f\n",
+                (double)prof->total.submits / prof->nr_frames,
+                (double)prof->total.dwords / prof->nr_frames,
+                (double)prof->total.blits / prof->nr_frames,
+                (double)prof->total.bytes / prof->nr_frames);
+    }
+}
+
+#endif /* HAVE_DRM_INTEL */
+#endif /* _MGGAL_DRM */
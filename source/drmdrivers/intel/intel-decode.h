@@ -0,0 +1,69 @@
+/*
+ * Copyright © 2023 FMSoft.CN
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _DRM_MINIGUI_INTEL_DECODE_H_
+#define _DRM_MINIGUI_INTEL_DECODE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * When enabled, the decoder walks every batch buffer before it is submitted
+ * and keeps the statistics of the command stream. It lists the commands of
+ * each batch if HBDDRM_I915_DECODE=1, and prints the statistics of each
+ * frame (the commands between two calls of flush_driver) if
+ * HBDDRM_I915_STATS=1. Either variable enables it from the start, and the
+ * first call of hbddrm_dump_stats() otherwise; the batches are not walked
+ * until then.
+ */
+
+struct intel_cs_stats {
+    unsigned int submits;
+    unsigned int dwords;
+    unsigned int relocs;
+    unsigned int blits;
+    unsigned int flushes;
+    uint64_t bytes;     /* the bytes read and written by the blits */
+};
+
+struct intel_cs_profiler {
+    bool enabled;
+    bool decode;
+    bool dump_frames;
+    unsigned int nr_frames;
+    struct intel_cs_stats frame;
+    struct intel_cs_stats total;
+};
+
+void intel_cs_profiler_init(struct intel_cs_profiler *prof) WTF_INTERNAL;
+
+void intel_cs_decode_batch(struct intel_cs_profiler *prof,
+        const uint32_t *map, unsigned int used, int nr_relocs,
+        unsigned int ring) WTF_INTERNAL;
+
+void intel_cs_end_frame(struct intel_cs_profiler *prof) WTF_INTERNAL;
+
+void intel_cs_dump_stats(const struct intel_cs_profiler *prof,
+        FILE *fp) WTF_INTERNAL;
+
+#endif /* _DRM_MINIGUI_INTEL_DECODE_H_ */
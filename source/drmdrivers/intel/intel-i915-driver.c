@@ -69,10 +69,13 @@
 
 #include "libdrm-macros.h"
 #include "helpers.h"
+#include "drivers.h"
 
 static void intel_batchbuffer_reset(struct _DrmDriver *driver)
 {
+    pthread_mutex_lock(&driver->reloc_lock);
     drm_intel_gem_bo_clear_relocs(driver->batch.bo, 0);
+    pthread_mutex_unlock(&driver->reloc_lock);
     driver->batch.reserved_space = BATCH_RESERVED;
     driver->batch.used = 0;
 }
@@ -94,14 +97,71 @@ static void intel_batchbuffer_free(struct _DrmDriver *driver)
     drm_intel_bo_unreference(driver->batch.bo);
 }
 
+struct intel_exec_job {
+    drm_intel_bo *bo;
+    int used;
+    unsigned int flags;
+};
+
+static void intel_run_exec_job(DrmDriver *driver, void *data)
+{
+    struct intel_exec_job *job = data;
+    int ret;
+
+    /* the exec walks the relocation tree, and writes the validation state
+       of the target objects, which the GUI thread may be emitting */
+    pthread_mutex_lock(&driver->reloc_lock);
+    ret = drm_intel_bo_mrb_exec(job->bo, job->used, NULL, 0, 0, job->flags);
+    drm_intel_bo_unreference(job->bo);
+    pthread_mutex_unlock(&driver->reloc_lock);
+
+    if (ret) {
+        _WRN_PRINTF("DRM>i915: failed to execute batch buffer: %s\n",
+                strerror(-ret));
+    }
+}
+
+/* Hands the uploaded batch buffer over to the executor, which owns it and
+   its relocations from now on, and takes a fresh one for the next batch. */
+static bool intel_queue_batch(struct _DrmDriver *driver, unsigned int flags)
+{
+    struct intel_batchbuffer *batch = &driver->batch;
+    struct intel_exec_job job;
+    drm_intel_bo *bo;
+
+    bo = drm_intel_bo_alloc(driver->manager, "batchbuffer",
+            driver->maxBatchSize, BATCH_SIZE);
+    if (bo == NULL)
+        return false;
+
+    job.bo = batch->bo;
+    job.used = 4 * batch->used;
+    job.flags = flags;
+    drm_executor_submit(driver->executor, intel_run_exec_job,
+            &job, sizeof(job));
+
+    batch->bo = bo;
+    return true;
+}
+
 static int intel_do_flush_locked(struct _DrmDriver *driver, unsigned int flags)
 {
     struct intel_batchbuffer *batch = &driver->batch;
     int ret = 0;
 
+    if (driver->profiler.enabled)
+        intel_cs_decode_batch(&driver->profiler, batch->map, batch->used,
+                drm_intel_gem_bo_get_reloc_count(batch->bo), flags);
+
     ret = drm_intel_bo_subdata(batch->bo, 0, 4 * batch->used, batch->map);
 
     if (ret == 0) {
+        if (driver->executor && intel_queue_batch(driver, flags))
+            return 0;
+
+        /* keep the order with the batches queued before */
+        if (driver->executor)
+            drm_executor_drain(driver->executor);
         ret = drm_intel_bo_mrb_exec(batch->bo, 4 * batch->used, NULL, 0, 0,
                 flags);
     }
@@ -144,9 +204,11 @@ static bool intel_batchbuffer_emit_reloc_fenced(struct _DrmDriver *driver,
 {
     int ret;
 
+    pthread_mutex_lock(&driver->reloc_lock);
     ret = drm_intel_bo_emit_reloc_fence(driver->batch.bo, 4*driver->batch.used,
             buffer, delta,
             read_domains, write_domain);
+    pthread_mutex_unlock(&driver->reloc_lock);
     assert(ret == 0);
     (void)ret;
 
@@ -303,15 +365,56 @@ failed:
     return -1;
 }
 
+static DrmSurfaceBuffer* i915_alloc_buffer (DrmDriver *driver,
+        uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t flags);
+static void i915_destroy_buffer (DrmDriver *driver,
+        DrmSurfaceBuffer* buffer);
+static int i915_fill_rect (DrmDriver *driver,
+        DrmSurfaceBuffer* dst_buf, const GAL_Rect* rc, uint32_t clear_value);
+static uint8_t* i915_map_buffer (DrmDriver *driver,
+        DrmSurfaceBuffer* buffer);
+static void i915_unmap_buffer (DrmDriver *driver,
+        DrmSurfaceBuffer* buffer);
+
+static DrmSurfaceBuffer* i915_create_atlas_page (DrmDriver *driver,
+        uint32_t drm_format, uint32_t width, uint32_t height)
+{
+    return i915_alloc_buffer (driver, drm_format, 0, width, height,
+            DRM_SURBUF_TYPE_OFFSCREEN);
+}
+
+static const DrmAtlasOps i915_atlas_ops = {
+    .create_page = i915_create_atlas_page,
+    .destroy_page = i915_destroy_buffer,
+};
+
+/* The first call enables the profiler, and the statistics start then. */
+static int i915_dump_stats (DrmDriver *driver, FILE *fp)
+{
+    intel_cs_dump_stats (&driver->profiler, fp);
+    driver->profiler.enabled = true;
+    return 0;
+}
+
+/* The mask blit is done by the CPU; the blitter engine does not blend. */
+static const DrmDriverExtOps i915_ext_ops = {
+    .dump_stats = i915_dump_stats,
+    .map_buffer = i915_map_buffer,
+    .unmap_buffer = i915_unmap_buffer,
+};
+
 static DrmDriver* i915_create_driver (int device_fd)
 {
     DrmDriver *driver;
 
     driver = calloc (1, sizeof (DrmDriver));
     driver->device_fd = device_fd;
+    pthread_mutex_init (&driver->reloc_lock, NULL);
 
     if (get_intel_chip_id (driver, device_fd)) {
         _ERR_PRINTF ("DRM>i915: failed to get genenration.\n");
+        pthread_mutex_destroy (&driver->reloc_lock);
         free (driver);
         return NULL;
     }
@@ -319,6 +422,7 @@ static DrmDriver* i915_create_driver (int device_fd)
     driver->manager = drm_intel_bufmgr_gem_init (driver->device_fd, BATCH_SZ);
     if (driver->manager == NULL) {
         _ERR_PRINTF ("DRM>i915: failed to initialize buffer manager\n");
+        pthread_mutex_destroy (&driver->reloc_lock);
         free (driver);
         return NULL;
     }
@@ -329,31 +433,66 @@ static DrmDriver* i915_create_driver (int device_fd)
 
     driver->maxBatchSize = BATCH_SIZE;
     intel_batchbuffer_init(driver);
+    intel_cs_profiler_init(&driver->profiler);
 
+    driver->atlas = drm_atlas_new(driver, &i915_atlas_ops);
+    driver->executor = drm_executor_new(driver);
+
+    drm_driver_register(driver, device_fd, &i915_ext_ops);
     return driver;
 }
 
 static void i915_destroy_driver (DrmDriver *driver)
 {
+    drm_driver_unregister(driver);
+    drm_atlas_delete(driver->atlas);
+
     if (driver->nr_buffers) {
         _WRN_PRINTF ("There is still %d buffers left\n", driver->nr_buffers);
     }
 
+    drm_executor_delete(driver->executor);
     intel_batchbuffer_free(driver);
     drm_intel_bufmgr_destroy (driver->manager);
+    pthread_mutex_destroy (&driver->reloc_lock);
     free (driver);
 }
 
 static void i915_flush_driver (DrmDriver *driver)
 {
     intel_batchbuffer_emit_mi_flush(driver);
+    if (driver->executor)
+        drm_executor_drain(driver->executor);
+
+    intel_cs_end_frame(&driver->profiler);
 }
 
 typedef struct _my_surface_buffer {
     DrmSurfaceBuffer base;
     drm_intel_bo *bo;
+    DrmAtlasSlot slot;
+
+    /* the sequence number of the last batch queued for this buffer */
+    uint64_t exec_seqno;
 } my_surface_buffer;
 
+/* Records that the batches queued so far touch the buffer. */
+static inline void i915_mark_buffer (DrmDriver *driver,
+        my_surface_buffer *buffer)
+{
+    if (driver->executor)
+        buffer->exec_seqno = drm_executor_last_seqno (driver->executor);
+}
+
+/* Waits until the batches touching the buffer are in the kernel; the
+   kernel then serializes the CPU access with the GPU. */
+static inline void i915_sync_buffer (DrmDriver *driver,
+        my_surface_buffer *buffer)
+{
+    if (driver->executor)
+        drm_executor_wait (driver->executor, buffer->exec_seqno);
+}
+
 static my_surface_buffer* i915_create_buffer_helper (DrmDriver *driver,
         drm_intel_bo *bo)
 {
@@ -376,7 +515,49 @@ static my_surface_buffer* i915_create_buffer_helper (DrmDriver *driver,
     return buffer;
 }
 
-static DrmSurfaceBuffer* i915_create_buffer (DrmDriver *driver,
+/* Suballocates a small surface from the atlas; it shares the GEM object
+   of the page, which is referenced by every slot. */
+static my_surface_buffer* i915_create_buffer_from_atlas (DrmDriver *driver,
+        uint32_t drm_format, int bpp, int cpp,
+        uint32_t width, uint32_t height)
+{
+    DrmAtlasSlot slot;
+    my_surface_buffer *page, *buffer;
+
+    if (drm_atlas_alloc (driver->atlas, drm_format, width, height, &slot))
+        return NULL;
+
+    page = (my_surface_buffer *)slot.page_buf;
+    buffer = i915_create_buffer_helper (driver, page->bo);
+    if (buffer == NULL) {
+        drm_atlas_free (driver->atlas, &slot);
+        return NULL;
+    }
+
+    drm_intel_bo_reference (page->bo);
+    buffer->slot = slot;
+
+    buffer->base.prime_fd = -1;
+    buffer->base.name = 0;
+    buffer->base.fb_id = 0;
+    buffer->base.drm_format = drm_format;
+    buffer->base.bpp = bpp;
+    buffer->base.cpp = cpp;
+    buffer->base.scanout = 0;
+    buffer->base.width = width;
+    buffer->base.height = height;
+    buffer->base.pitch = page->base.pitch;
+    buffer->base.offset = slot.y * page->base.pitch + slot.x * cpp;
+    buffer->base.buff = NULL;
+
+    _DBG_PRINTF ("Allocate surface buffer in atlas page (%u): "
+            "width (%d), height (%d), (pitch: %d), offset (%ld)\n",
+            buffer->base.handle, buffer->base.width, buffer->base.height,
+            buffer->base.pitch, buffer->base.offset);
+    return buffer;
+}
+
+static DrmSurfaceBuffer* i915_alloc_buffer (DrmDriver *driver,
         uint32_t drm_format, uint32_t hdr_size,
         uint32_t width, uint32_t height, uint32_t flags)
 {
@@ -390,6 +571,14 @@ static DrmSurfaceBuffer* i915_create_buffer (DrmDriver *driver,
         return NULL;
     }
 
+    if (driver->atlas &&
+            IS_SURFACE_FOR_ATLAS(hdr_size, width, height, flags)) {
+        buffer = i915_create_buffer_from_atlas (driver, drm_format, bpp, cpp,
+                width, height);
+        if (buffer)
+            return &buffer->base;
+    }
+
     pitch = ROUND_TO_MULTIPLE (width * cpp, 256);
     if (hdr_size) {
         nr_hdr_lines = hdr_size / pitch;
@@ -434,6 +623,25 @@ static DrmSurfaceBuffer* i915_create_buffer (DrmDriver *driver,
     return &buffer->base;
 }
 
+static DrmSurfaceBuffer* i915_create_buffer (DrmDriver *driver,
+        uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t flags)
+{
+    DrmSurfaceBuffer *buffer;
+    uint32_t pixel;
+
+    buffer = i915_alloc_buffer (driver, drm_format, hdr_size,
+            width, height, flags);
+    if (buffer && drm_driver_clear_on_create (driver, flags, &pixel)) {
+        GAL_Rect rc = { 0, 0, (int)width, (int)height };
+
+        /* clear the new surface with the blitter instead of the CPU */
+        i915_fill_rect (driver, buffer, &rc, pixel);
+    }
+
+    return buffer;
+}
+
 #ifdef DRM_INTEL_HAVE_CREATE_FROM_HANDLE
 
 static inline drm_intel_bo * create_bo_from_handle (DrmDriver *driver,
@@ -620,12 +828,13 @@ static DrmSurfaceBuffer* i915_create_buffer_from_prime_fd (DrmDriver *driver,
 static uint8_t* i915_map_buffer (DrmDriver *driver,
         DrmSurfaceBuffer* buffer)
 {
-    (void)driver;
     my_surface_buffer *my_buffer = (my_surface_buffer *)buffer;
 
     assert (my_buffer != NULL);
     assert (my_buffer->base.buff == NULL);
 
+    i915_sync_buffer (driver, my_buffer);
+
     if (buffer->scanout) {
         drm_intel_gem_bo_map_gtt (my_buffer->bo);
     }
@@ -666,7 +875,10 @@ static void i915_destroy_buffer (DrmDriver *driver,
             drm_intel_bo_unmap (my_buffer->bo);
     }
 
+    /* the relocations of a queued batch keep their own references */
     drm_intel_bo_unreference (my_buffer->bo);
+    if (my_buffer->slot.page)
+        drm_atlas_free (driver->atlas, &my_buffer->slot);
     free (my_buffer);
 
     driver->nr_buffers--;
@@ -698,14 +910,108 @@ static inline uint32_t br13_for_cpp(int cpp)
     }
 }
 
+static inline unsigned int i915_blt_ring(DrmDriver *driver)
+{
+    return (driver->gen > 4) ? I915_EXEC_BLT : I915_EXEC_RENDER;
+}
+
+/* One surface involved in a blitter operation. */
+struct blt_side {
+    drm_intel_bo *bo;
+    uint32_t offset;
+    int pitch;
+    int cpp;
+    int x, y;
+};
+
+/* The part of a surface covered by one tile of a split operation. */
+struct blt_tile {
+    uint32_t delta;     /* the relocation delta for the base address */
+    int pitch;          /* the pitch to program */
+    int x, y;           /* the top-left corner relative to the delta */
+};
+
+/*
+ * Computes the largest tile which the legacy blitter can address on every
+ * surface of an operation of w x h pixels. The whole operation is a single
+ * tile unless a coordinate overflows; a surface whose pitch does not fit in
+ * BR13 is walked one row at a time.
+ */
+static void blt_get_tile_size(const struct blt_side *sides, int nr_sides,
+        int w, int h, int *tw, int *th)
+{
+    int i;
+
+    *tw = w;
+    *th = h;
+    for (i = 0; i < nr_sides; i++) {
+        const struct blt_side *side = sides + i;
+
+        if (side->pitch > BLT_MAX_PITCH) {
+            *th = 1;
+            *tw = MIN(*tw, BLT_MAX_PITCH / side->cpp);
+        }
+        else {
+            if (side->y + h > BLT_MAX_COORD)
+                *th = MIN(*th, BLT_MAX_COORD);
+            if (side->x + w > BLT_MAX_COORD)
+                *tw = MIN(*tw, BLT_MAX_COORD);
+        }
+    }
+}
+
+/*
+ * Locates the tile of tw x th pixels at (tx, ty) of the operation on one
+ * surface. The tile keeps the base address and the coordinates of the
+ * surface when they are legal; otherwise its origin is band-offset into
+ * the relocation delta.
+ */
+static void blt_locate_tile(const struct blt_side *side,
+        int tx, int ty, int tw, int th, struct blt_tile *tile)
+{
+    int x = side->x + tx;
+    int y = side->y + ty;
+
+    tile->delta = side->offset;
+    tile->pitch = side->pitch;
+    tile->x = x;
+    tile->y = y;
+
+    if (side->pitch > BLT_MAX_PITCH) {
+        /* A single row; the pitch is never used by the blitter. */
+        assert(th == 1);
+        tile->delta += y * side->pitch + x * side->cpp;
+        tile->pitch = ROUND_TO_MULTIPLE(tw * side->cpp, 4);
+        tile->x = 0;
+        tile->y = 0;
+        return;
+    }
+
+    if (y + th > BLT_MAX_COORD) {
+        tile->delta += y * side->pitch;
+        tile->y = 0;
+    }
+
+    if (x + tw > BLT_MAX_COORD) {
+        tile->delta += x * side->cpp;
+        tile->x = 0;
+    }
+}
+
+static inline void i915_blt_require_space(DrmDriver *driver, int n)
+{
+    if (intel_batchbuffer_space(driver) < n * 4u)
+        intel_batchbuffer_flush(driver, i915_blt_ring(driver));
+}
+
 static int i915_fill_rect (DrmDriver *driver,
         DrmSurfaceBuffer* dst_buf, const GAL_Rect* rc, uint32_t clear_value)
 {
-    (void)driver;
     my_surface_buffer *buffer;
     drm_intel_bo *aper_array[2];
     uint32_t BR13, CMD;
-    int x1, y1, x2, y2;
+    struct blt_side dst;
+    int tx, ty, tw, th;
 
     buffer = (my_surface_buffer*)dst_buf;
     assert (buffer != NULL);
@@ -723,24 +1029,24 @@ static int i915_fill_rect (DrmDriver *driver,
             buffer->base.pitch, buffer->base.cpp,
             buffer->base.width, buffer->base.height);
 
-    BR13 |= buffer->base.pitch;
     BR13 |= br13_for_cpp(buffer->base.cpp);
 
-    x1 = rc->x;
-    y1 = rc->y;
-    x2 = rc->x + rc->w;
-    y2 = rc->y + rc->h;
+    dst.bo = buffer->bo;
+    dst.offset = dst_buf->offset;
+    dst.pitch = buffer->base.pitch;
+    dst.cpp = buffer->base.cpp;
+    dst.x = rc->x;
+    dst.y = rc->y;
 
 #if 0
     if (dst_buf->offset) {
         int nr_lines = dst_buf->offset/dst_buf->pitch;
-        y1 += nr_lines;
-        y2 += nr_lines;
+        dst.y += nr_lines;
     }
 #endif
 
-    assert(x1 < x2);
-    assert(y1 < y2);
+    assert(rc->w > 0);
+    assert(rc->h > 0);
 
     /* do space check before going any further */
     aper_array[0] = driver->batch.bo;
@@ -748,24 +1054,37 @@ static int i915_fill_rect (DrmDriver *driver,
 
     if (drm_intel_bufmgr_check_aperture_space(aper_array,
                 TABLESIZE(aper_array)) != 0) {
-        intel_batchbuffer_flush(driver,
-                (driver->gen > 4) ? I915_EXEC_BLT : I915_EXEC_RENDER);
-    }
-
-    intel_batchbuffer_begin(driver, 6);
-    intel_batchbuffer_emit_dword(driver, CMD | (6 - 2));
-    intel_batchbuffer_emit_dword(driver, BR13);
-    intel_batchbuffer_emit_dword(driver, (y1 << 16) | x1);
-    intel_batchbuffer_emit_dword(driver, (y2 << 16) | x2);
-    intel_batchbuffer_emit_reloc_fenced(driver, buffer->bo,
-            I915_GEM_DOMAIN_RENDER, I915_GEM_DOMAIN_RENDER,
-            dst_buf->offset);
-    intel_batchbuffer_emit_dword(driver, clear_value);
-    intel_batchbuffer_advance(driver);
-    intel_batchbuffer_flush(driver,
-            (driver->gen > 4) ? I915_EXEC_BLT : I915_EXEC_RENDER);
+        intel_batchbuffer_flush(driver, i915_blt_ring(driver));
+    }
+
+    blt_get_tile_size(&dst, 1, rc->w, rc->h, &tw, &th);
+    for (ty = 0; ty < rc->h; ty += th) {
+        for (tx = 0; tx < rc->w; tx += tw) {
+            struct blt_tile tile;
+            int w = MIN(tw, rc->w - tx);
+            int h = MIN(th, rc->h - ty);
+
+            blt_locate_tile(&dst, tx, ty, w, h, &tile);
+
+            i915_blt_require_space(driver, 6);
+            intel_batchbuffer_begin(driver, 6);
+            intel_batchbuffer_emit_dword(driver, CMD | (6 - 2));
+            intel_batchbuffer_emit_dword(driver, BR13 | tile.pitch);
+            intel_batchbuffer_emit_dword(driver, (tile.y << 16) | tile.x);
+            intel_batchbuffer_emit_dword(driver,
+                    ((tile.y + h) << 16) | (tile.x + w));
+            intel_batchbuffer_emit_reloc_fenced(driver, buffer->bo,
+                    I915_GEM_DOMAIN_RENDER, I915_GEM_DOMAIN_RENDER,
+                    tile.delta);
+            intel_batchbuffer_emit_dword(driver, clear_value);
+            intel_batchbuffer_advance(driver);
+        }
+    }
+
+    intel_batchbuffer_flush(driver, i915_blt_ring(driver));
 
     intel_batchbuffer_emit_mi_flush(driver);
+    i915_mark_buffer(driver, buffer);
     return 0;
 }
 
@@ -776,42 +1095,42 @@ static int i915_copy_blit(DrmDriver *driver,
 {
     my_surface_buffer *buffer;
     unsigned int cpp;
-    int src_pitch;
-    drm_intel_bo *src_bo;
-    unsigned int src_offset = src_buf->offset;
-    int dst_pitch;
-    drm_intel_bo *dst_bo;
-    unsigned int dst_offset = dst_buf->offset;
-    int src_x = src_rc->x, src_y = src_rc->y;
-    int dst_x = dst_rc->x, dst_y = dst_rc->y;
+    struct blt_side sides[2];   /* [0] for the destination, [1] the source */
+    struct blt_side *dst = sides, *src = sides + 1;
     int w = src_rc->w, h = src_rc->h;
+    int nr_rows, nr_cols, row, col, tw, th;
+    bool reverse_x, reverse_y;
 
     unsigned int CMD, BR13, pass;
-    int dst_x2 = dst_x + w;
-    int dst_y2 = dst_y + h;
     drm_intel_bo *aper_array[3];
 
     buffer = (my_surface_buffer*)src_buf;
     assert (buffer != NULL);
-    src_bo = buffer->bo;
-    src_pitch = buffer->base.pitch;
-    cpp = buffer->base.cpp;
+    src->bo = buffer->bo;
+    src->offset = src_buf->offset;
+    src->pitch = buffer->base.pitch;
+    src->cpp = cpp = buffer->base.cpp;
+    src->x = src_rc->x;
+    src->y = src_rc->y;
 
     buffer = (my_surface_buffer*)dst_buf;
     assert (buffer != NULL);
-    dst_bo = buffer->bo;
-    dst_pitch = buffer->base.pitch;
+    dst->bo = buffer->bo;
+    dst->offset = dst_buf->offset;
+    dst->pitch = buffer->base.pitch;
+    dst->cpp = cpp;
+    dst->x = dst_rc->x;
+    dst->y = dst_rc->y;
 
     /* do space check before going any further */
     pass = 0;
     do {
         aper_array[0] = driver->batch.bo;
-        aper_array[1] = dst_bo;
-        aper_array[2] = src_bo;
+        aper_array[1] = dst->bo;
+        aper_array[2] = src->bo;
 
         if (dri_bufmgr_check_aperture_space(aper_array, 3) != 0) {
-            intel_batchbuffer_flush(driver,
-                    (driver->gen > 4) ? I915_EXEC_BLT : I915_EXEC_RENDER);
+            intel_batchbuffer_flush(driver, i915_blt_ring(driver));
             pass++;
         } else
             break;
@@ -820,20 +1139,18 @@ static int i915_copy_blit(DrmDriver *driver,
     if (pass >= 2)
         return -1;
 
-    intel_batchbuffer_require_space(driver, 8 * 4);
-
     _DBG_PRINTF("src:buf(%p)/%d+%d %d,%d dst:buf(%p)/%d+%d %d,%d sz:%dx%d\n",
-            src_bo, src_pitch, src_offset, src_x, src_y,
-            dst_bo, dst_pitch, dst_offset, dst_x, dst_y, w, h);
+            src->bo, src->pitch, src->offset, src->x, src->y,
+            dst->bo, dst->pitch, dst->offset, dst->x, dst->y, w, h);
 
-    _DBG_PRINTF("src cpp: %d src offset(%d)\n", cpp, src_offset);
+    _DBG_PRINTF("src cpp: %d src offset(%d)\n", cpp, src->offset);
 
     /* Blit pitch must be dword-aligned.  Otherwise, the hardware appears to drop
      * the low bits.  Offsets must be naturally aligned.
      */
-    if (src_pitch % 4 != 0 || dst_pitch % 4 != 0) {
+    if (src->pitch % 4 != 0 || dst->pitch % 4 != 0) {
         _WRN_PRINTF("pitches are not dword-aligned: src(%d), dst(%d)\n",
-                src_pitch, dst_pitch);
+                src->pitch, dst->pitch);
         return -1;
     }
 
@@ -853,34 +1170,57 @@ static int i915_copy_blit(DrmDriver *driver,
             return -1;
     }
 
-    if (dst_y2 <= dst_y || dst_x2 <= dst_x) {
+    if (h <= 0 || w <= 0) {
         _WRN_PRINTF("bad destination rectangle: (%d, %d, %d, %d)\n",
-                dst_x, dst_y, dst_x2, dst_y2);
+                dst->x, dst->y, dst->x + w, dst->y + h);
         return -1;
     }
 
-    assert(dst_x < dst_x2);
-    assert(dst_y < dst_y2);
-
-    intel_batchbuffer_begin(driver, 8);
+    /* Keep the order of the tiles safe when scrolling within a surface. */
+    reverse_x = (src->bo == dst->bo && dst->x > src->x);
+    reverse_y = (src->bo == dst->bo && dst->y > src->y);
+
+    blt_get_tile_size(sides, TABLESIZE(sides), w, h, &tw, &th);
+    nr_rows = (h + th - 1) / th;
+    nr_cols = (w + tw - 1) / tw;
+    for (row = 0; row < nr_rows; row++) {
+        int ty = (reverse_y ? (nr_rows - 1 - row) : row) * th;
+        int tile_h = MIN(th, h - ty);
+
+        for (col = 0; col < nr_cols; col++) {
+            int tx = (reverse_x ? (nr_cols - 1 - col) : col) * tw;
+            int tile_w = MIN(tw, w - tx);
+            struct blt_tile dst_tile, src_tile;
+
+            blt_locate_tile(dst, tx, ty, tile_w, tile_h, &dst_tile);
+            blt_locate_tile(src, tx, ty, tile_w, tile_h, &src_tile);
+
+            i915_blt_require_space(driver, 8);
+            intel_batchbuffer_begin(driver, 8);
+            intel_batchbuffer_emit_dword(driver, CMD | (8 - 2));
+            intel_batchbuffer_emit_dword(driver, BR13 | dst_tile.pitch);
+            intel_batchbuffer_emit_dword(driver,
+                    (dst_tile.y << 16) | dst_tile.x);
+            intel_batchbuffer_emit_dword(driver,
+                    ((dst_tile.y + tile_h) << 16) | (dst_tile.x + tile_w));
+            intel_batchbuffer_emit_reloc_fenced(driver, dst->bo,
+                    I915_GEM_DOMAIN_RENDER, I915_GEM_DOMAIN_RENDER,
+                    dst_tile.delta);
+            intel_batchbuffer_emit_dword(driver,
+                    (src_tile.y << 16) | src_tile.x);
+            intel_batchbuffer_emit_dword(driver, src_tile.pitch);
+            intel_batchbuffer_emit_reloc_fenced(driver, src->bo,
+                    I915_GEM_DOMAIN_RENDER, 0,
+                    src_tile.delta);
+            intel_batchbuffer_advance(driver);
+        }
+    }
 
-    intel_batchbuffer_emit_dword(driver, CMD | (8 - 2));
-    intel_batchbuffer_emit_dword(driver, BR13 | (uint16_t)dst_pitch);
-    intel_batchbuffer_emit_dword(driver, (dst_y << 16) | dst_x);
-    intel_batchbuffer_emit_dword(driver, (dst_y2 << 16) | dst_x2);
-    intel_batchbuffer_emit_reloc_fenced(driver, dst_bo,
-            I915_GEM_DOMAIN_RENDER, I915_GEM_DOMAIN_RENDER,
-            dst_offset);
-    intel_batchbuffer_emit_dword(driver, (src_y << 16) | src_x);
-    intel_batchbuffer_emit_dword(driver, (uint16_t)src_pitch);
-    intel_batchbuffer_emit_reloc_fenced(driver, src_bo,
-            I915_GEM_DOMAIN_RENDER, 0,
-            src_offset);
-    intel_batchbuffer_advance(driver);
-    intel_batchbuffer_flush(driver,
-            (driver->gen > 4) ? I915_EXEC_BLT : I915_EXEC_RENDER);
+    intel_batchbuffer_flush(driver, i915_blt_ring(driver));
 
     intel_batchbuffer_emit_mi_flush(driver);
+    i915_mark_buffer(driver, (my_surface_buffer*)src_buf);
+    i915_mark_buffer(driver, (my_surface_buffer*)dst_buf);
     return 0;
 }
 
@@ -251,5 +251,10 @@
 #define BR13_565		(0x1 << 24)
 #define BR13_8888		(0x3 << 24)
 
+/* The pitch in BR13/BR12 and the coordinates in BR01/BR02/BR05 are signed
+ * 16-bit fields; the pitch has to be dword-aligned as well. */
+#define BLT_MAX_PITCH		0x7FFC
+#define BLT_MAX_COORD		0x7FFF
+
 #endif /* _DRM_MINIGUI_INTEL_REG_H_ */
 
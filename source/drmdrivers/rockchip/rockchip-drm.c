@@ -28,8 +28,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
 
 #include <sys/mman.h>
+#include <poll.h>
+#include <linux/sync_file.h>
+#include <linux/dma-buf.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -41,8 +46,6 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
-#define _DEBUG
-
 #include <minigui/common.h>
 #include <minigui/minigui.h>
 #include <minigui/gdi.h>
@@ -54,12 +57,258 @@
 
 #include "libdrm-macros.h"
 #include "helpers.h"
+#include "atlas.h"
+#include "executor.h"
+#include "drivers.h"
+#include "hbddrmdrivers.h"
 
 #include "rockchip-drm.h"
 
+/* The job API (imbeginJob() and friends) appeared in librga 1.9. */
+#if RGA_API_MAJOR_VERSION > 1 || \
+    (RGA_API_MAJOR_VERSION == 1 && RGA_API_MINOR_VERSION >= 9)
+#define RGA_HAVE_JOB_API    1
+
+/* The maximal number of buffers touched by the tasks in a job, and of the
+   tasks in a job. */
+#define RGA_JOB_MAX_BUFS    128
+#define RGA_JOB_MAX_TASKS   256
+#endif
+
+/* im2d does not dither; the ordered dither of RGA2 for the destinations of
+   lower depth is done through c_RkRgaBlit(), which takes the buffer handles
+   of librga 1.9 as well. */
+#if RGA_API_MAJOR_VERSION > 1 || \
+    (RGA_API_MAJOR_VERSION == 1 && RGA_API_MINOR_VERSION >= 9)
+#define RGA_HAVE_DITHER     1
+#include <RgaApi.h>
+#endif
+
+/* RGA3 writes (and reads) the AFBC layout of the display controller: 16x16
+   superblocks with the YUV transform for RGB. The rd_mode of rga_buffer_t
+   came with librga 1.9. */
+#if defined(DRM_FORMAT_MOD_ARM_AFBC) && (RGA_API_MAJOR_VERSION > 1 || \
+    (RGA_API_MAJOR_VERSION == 1 && RGA_API_MINOR_VERSION >= 9))
+#define RK_HAVE_AFBC        1
+#define RK_AFBC_MODIFIER    DRM_FORMAT_MOD_ARM_AFBC(    \
+        AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE | \
+        AFBC_FORMAT_MOD_YTR)
+#endif
+
+/* The size of an AFBC superblock in pixels, and the alignment of the
+   header of the superblocks in bytes. */
+#define RK_AFBC_BLOCK_SIZE      16
+#define RK_AFBC_HEADER_ALIGN    4096
+
+/* The number of the surfaces the masks of a frame are expanded into, and
+   their default size in pixels; a larger mask gets a larger surface. */
+#define RK_MASK_BUFS            4
+#define RK_MASK_BUF_SIZE        512
+
+/* The default cap of the GEM objects kept for recycling, in MiB;
+   HBDDRM_BO_POOL_SIZE overrides it, 0 disables the pool. */
+#define RK_BO_POOL_DEFAULT_SIZE     16
+
+/* A released GEM object kept for recycling, with its prime fd, RGA handle,
+   and mapping if any. */
+struct rockchip_pooled_bo {
+    struct rockchip_pooled_bo *next;
+    size_t size;
+    uint32_t rk_flags;
+    uint32_t handle;
+    int prime_fd;
+    rga_buffer_handle_t rga_handle;
+    im_handle_param_t rga_param;
+    uint8_t *map;
+};
+
+/* A GEM object imported by a flink name or a prime fd, shared by the
+   surfaces created on it, so that one handle is kept per name or per
+   dma-buf; the key is the name, or the handle of the dma-buf. It keeps the
+   RGA handle of the first layout imported, and the mapping of the whole
+   object. */
+struct rockchip_import {
+    struct rockchip_import *next;
+    unsigned nr_refs;
+    uint32_t name;
+    size_t size;
+    uint32_t handle;
+    int prime_fd;
+    rga_buffer_handle_t rga_handle;
+    im_handle_param_t rga_param;
+    uint8_t *map;
+};
+
+/* The number of entries in the cache of imcheck() results. */
+#define RGA_CHECK_CACHE_SIZE    64
+
+/*
+ * The result of imcheck() depends on the formats, the usage, and the
+ * geometry; the geometry is reduced to a class of the properties checked
+ * by librga: the alignment of strides and rectangles, the minimal and
+ * maximal sizes, and the scaling factors.
+ */
+struct rga_check_entry {
+    int src_format;
+    int dst_format;
+    int pat_format;
+    int usage;
+    uint32_t geometry;
+    bool used;
+    IM_STATUS status;
+};
+
+/* The per-operation interpolation (im_opt_t.interp) and the IM_INTERP_*
+   enumerators appeared in librga 1.10; the interpolation is set for both
+   directions. Without it, the hardware scales with its default one. */
+#if RGA_API_MAJOR_VERSION > 1 || \
+    (RGA_API_MAJOR_VERSION == 1 && RGA_API_MINOR_VERSION >= 10)
+#define RGA_HAVE_INTERP     1
+#define RGA_INTERP(mode)    \
+    ((mode) << IM_INTERP_HORIZ_SHIFT | (mode) << IM_INTERP_VERTI_SHIFT)
+
+#define RGA_INTERP_BIT(mode)    (1u << (mode))
+
+/*
+ * The interpolations a version of RGA does, for upscaling and downscaling;
+ * the version is matched against the string of querystring(RGA_VERSION),
+ * the more specific ones first.
+ */
+struct rga_interp_caps {
+    const char *version;
+    unsigned up;
+    unsigned down;
+};
+
+static const struct rga_interp_caps rga_interp_caps_table[] = {
+    { "RGA_3",
+        RGA_INTERP_BIT(IM_INTERP_LINEAR),
+        RGA_INTERP_BIT(IM_INTERP_LINEAR) },
+    { "RGA_2_Enhance",
+        RGA_INTERP_BIT(IM_INTERP_CUBIC) | RGA_INTERP_BIT(IM_INTERP_LINEAR),
+        RGA_INTERP_BIT(IM_INTERP_LINEAR) | RGA_INTERP_BIT(IM_INTERP_AVERAGE) },
+    { "RGA_2",
+        RGA_INTERP_BIT(IM_INTERP_CUBIC) | RGA_INTERP_BIT(IM_INTERP_LINEAR),
+        RGA_INTERP_BIT(IM_INTERP_LINEAR) | RGA_INTERP_BIT(IM_INTERP_AVERAGE) },
+    /* RGA 1 and the unknown ones */
+    { "",
+        RGA_INTERP_BIT(IM_INTERP_LINEAR),
+        RGA_INTERP_BIT(IM_INTERP_LINEAR) },
+};
+#endif /* RGA_HAVE_INTERP */
+
+/* The maximal number of RGA cores of a SoC; RK3588 has two RGA3 cores
+   and one RGA2 core. */
+#define RGA_MAX_CORES           4
+
+/* The RGA2 core 1 of RK3576 is not named by all versions of librga. */
+#define RGA_SCHEDULER_RGA2_CORE1    (IM_SCHEDULER_RGA2_CORE0 << 1)
+
+#define RGA3_CORES  (IM_SCHEDULER_RGA3_CORE0 | IM_SCHEDULER_RGA3_CORE1)
+
+/* An operation is split into bands for the cores if it is larger. */
+#define RGA_BAND_MIN_PIXELS     (1280 * 720)
+
+/* The failures are reported in a summary at most every so many seconds. */
+#define RGA_REPORT_INTERVAL     10
+
+/* One RGA operation; a fill has an empty source, and only a composition
+   has the pattern, which is the background blended with the source. A
+   dithered one is a copy, which may be scaled or transformed. */
+struct rga_job {
+    rga_buffer_t src;
+    rga_buffer_t dst;
+    rga_buffer_t pat;
+    im_rect src_rect;
+    im_rect dst_rect;
+    im_rect pat_rect;
+    im_opt_t opt;
+    int usage;
+    bool dither;
+};
+
 struct _DrmDriver {
     int devfd;
     unsigned nr_bufs;
+    DrmAtlas *atlas;
+    DrmExecutor *executor;
+    /* the merged release fence of the RGA jobs submitted */
+    int fence;
+
+    /* the pool of GEM objects; the most recently released first */
+    struct rockchip_pooled_bo *pool;
+    size_t pool_size;
+    size_t pool_max_size;
+
+    /* the GEM objects imported by names and prime fds */
+    struct rockchip_import *imports;
+
+    /* the live buffers owning a GEM object created by us */
+    struct my_surface_buffer *local_bufs;
+
+    /* the ARGB8888 surfaces the masks are expanded into, filled in turn in
+       rows; the room taken is reused after flush_driver only */
+    struct my_surface_buffer *mask_bufs[RK_MASK_BUFS];
+    unsigned cur_mask_buf;
+    unsigned nr_mask_bufs_filled;
+    int mask_x, mask_y, mask_row_height;
+
+#ifdef RGA_HAVE_INTERP
+    /* the interpolations of the RGA in use */
+    const struct rga_interp_caps *interp_caps;
+#endif
+
+    /* the cores to schedule the jobs on (IM_SCHEDULER_*), none if librga
+       chooses the core (HBDDRM_RGA_CORES=0 or a single core) */
+    int nr_cores;
+    int cores[RGA_MAX_CORES];
+    unsigned next_core;
+
+    /* RGA2 is there, which does every ROP3 code */
+    bool has_rop3;
+
+    /* dither the copies into a destination of lower depth
+       (HBDDRM_RGA_DITHER=0 to disable) */
+    bool dither;
+
+    /* RGA3 is there, which writes the AFBC scanout surfaces */
+    bool has_rga3;
+
+    /* call imcheck() for every operation (HBDDRM_RGA_VALIDATE=1) */
+    bool validate;
+    struct rga_check_entry check_cache[RGA_CHECK_CACHE_SIZE];
+    /* the status of the last check failed, counted on a fallback */
+    IM_STATUS check_status;
+
+    /* the counters; the executor thread counts in the atomic ones */
+    HbdDrmHwStats stats;
+    atomic_uint_fast64_t exec_timed_jobs;
+    atomic_uint_fast64_t exec_time_ns;
+    atomic_uint_fast64_t exec_failures;
+    atomic_int exec_status;
+
+    /* the last failure, and the counters at the last summary; with the
+       executor, the jobs fail in the executor thread only */
+    const char *last_failure;
+    IM_STATUS last_status;
+    uint64_t report_time_ns;
+    uint64_t reported_failures;
+    uint64_t reported_fallbacks;
+
+#ifdef RGA_HAVE_JOB_API
+    /* Fills and blits are collected in a job, which is submitted by
+       flush_driver or before the CPU accesses a buffer in the job. */
+    bool batching;
+    im_job_handle_t job;
+    unsigned job_serial;
+    int job_fence;
+    int nr_job_bufs;
+    struct my_surface_buffer *job_bufs[RGA_JOB_MAX_BUFS];
+    /* the tasks of the pending job, run one by one if imendJob() fails;
+       an outline is logged as four fills */
+    int nr_job_tasks;
+    struct rga_job *job_tasks;
+#endif
 };
 
 typedef struct my_surface_buffer {
@@ -69,8 +318,436 @@ typedef struct my_surface_buffer {
     uint32_t            rk_flags;
     rga_buffer_handle_t rga_handle;
     rga_buffer_t        rga_buffer;
+    bool                rga_import_failed;
+    /* the persistent mapping; NULL for a surface in an atlas page */
+    uint8_t            *map;
+    /* the GEM object was created by us and can be recycled; the buffer is
+       in the list of local buffers then */
+    bool                recyclable;
+    struct my_surface_buffer *next_local;
+    /* the prime fd got by the driver itself for RGA or the CPU sync; a
+       prime fd other than it was got by MiniGUI to share the object */
+    int                 own_prime_fd;
+    /* the slot in an atlas page; the buffer of the page owns the GEM object,
+       the prime fd, and the RGA handle */
+    DrmAtlasSlot        slot;
+    /* the sequence number of the last RGA job queued for this buffer */
+    uint64_t            exec_seqno;
+    /* the release fence of the last RGA job touching this buffer */
+    int                 fence;
+    /* the conversion to RGB of a YUV surface (IM_YUV_TO_RGB_*) */
+    int                 color_space;
+    /* the surface is in AFBC; only RGA3 can write it */
+    bool                afbc;
+    /* the memory of the application the surface is created on */
+    uint8_t            *vaddr;
+    /* the imported GEM object, which owns the handle, the prime fd, and the
+       mapping; and the RGA handle if it is the one of the import */
+    struct rockchip_import *import;
+#ifdef RGA_HAVE_JOB_API
+    /* the serial number of the pending job touching this buffer */
+    unsigned            job_serial;
+#endif
 } my_surface_buffer;
 
+/* Convert a rectangle in the surface to the one in the RGA buffer. */
+static inline im_rect to_imrect(const my_surface_buffer *buf,
+        const GAL_Rect *rc)
+{
+    im_rect imrc = { rc->x + (int)buf->slot.x,
+        rc->y + buf->nr_hdr_lines + (int)buf->slot.y, rc->w, rc->h };
+    return imrc;
+}
+
+/* librga reports success with IM_STATUS_SUCCESS or IM_STATUS_NOERROR. */
+static inline bool rga_failed(IM_STATUS status)
+{
+    return status != IM_STATUS_SUCCESS && status != IM_STATUS_NOERROR;
+}
+
+/* Wait for a fence and close it. */
+static void wait_fence(int *fence)
+{
+    struct pollfd pfd = { .fd = *fence, .events = POLLIN };
+
+    if (*fence < 0)
+        return;
+
+    while (poll(&pfd, 1, -1) < 0 && (errno == EINTR || errno == EAGAIN))
+        ;
+
+    close(*fence);
+    *fence = -1;
+}
+
+/* Merge two fences into a new one; either can be -1. */
+static int merge_fences(int fence1, int fence2)
+{
+    struct sync_merge_data data = { .fd2 = fence2 };
+
+    if (fence1 < 0 && fence2 < 0)
+        return -1;
+    if (fence1 < 0)
+        return dup(fence2);
+    if (fence2 < 0 || fence1 == fence2)
+        return dup(fence1);
+
+    strcpy(data.name, "hbddrm-rga");
+    if (ioctl(fence1, SYNC_IOC_MERGE, &data) < 0) {
+        /* fall back to wait for one of them on the CPU */
+        _WRN_PRINTF("Failed SYNC_IOC_MERGE: %m\n");
+        int fence = dup(fence1);
+        wait_fence(&fence);
+        return dup(fence2);
+    }
+
+    return data.fence;
+}
+
+/* Replace the fence of a buffer; the buffer takes the ownership. */
+static inline void set_fence(my_surface_buffer *buf, int fence)
+{
+    if (buf->fence >= 0)
+        close(buf->fence);
+    buf->fence = fence;
+}
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t get_nr_failures(DrmDriver *drv)
+{
+    return drv->stats.nr_failures + atomic_load(&drv->exec_failures);
+}
+
+static uint64_t get_nr_fallbacks(DrmDriver *drv)
+{
+    uint64_t nr = 0;
+    int i;
+
+    for (i = 0; i < HBDDRM_NR_FALLBACKS; i++)
+        nr += drv->stats.nr_fallbacks[i];
+    return nr;
+}
+
+/*
+ * Print a summary of the failures since the last one, at most once per
+ * RGA_REPORT_INTERVAL; the operations left to the CPU are in it, but are
+ * not worth a warning alone. Called by the main thread only.
+ */
+static void report_failures(DrmDriver *drv, bool force)
+{
+    uint64_t now = get_time_ns();
+    uint64_t failures, fallbacks;
+    const char *call = drv->last_failure;
+    IM_STATUS status = drv->last_status;
+
+    if (!force && now - drv->report_time_ns <
+            (uint64_t)RGA_REPORT_INTERVAL * 1000000000)
+        return;
+
+    failures = get_nr_failures(drv) - drv->reported_failures;
+    fallbacks = get_nr_fallbacks(drv) - drv->reported_fallbacks;
+    if (failures && drv->executor) {
+        call = "improcess()";
+        status = (IM_STATUS)atomic_load(&drv->exec_status);
+    }
+
+    if (failures) {
+        _WRN_PRINTF("DRM>ROCKCHIP: %llu RGA jobs failed (the last %s: %s), "
+                "%llu operations left to the CPU\n",
+                (unsigned long long)failures, call, imStrError(status),
+                (unsigned long long)fallbacks);
+    }
+    else if (fallbacks) {
+        _DBG_PRINTF("DRM>ROCKCHIP: %llu operations left to the CPU\n",
+                (unsigned long long)fallbacks);
+    }
+    else {
+        return;
+    }
+
+    drv->report_time_ns = now;
+    drv->reported_failures += failures;
+    drv->reported_fallbacks += fallbacks;
+}
+
+/* Count a failed librga call; it is reported in the next summary. */
+static void count_failure(DrmDriver *drv, const char *call, IM_STATUS status)
+{
+    drv->stats.nr_failures++;
+    drv->last_failure = call;
+    drv->last_status = status;
+    report_failures(drv, false);
+}
+
+/* Count an operation left to the CPU; returns -1 for the callers. */
+static inline int fall_back(DrmDriver *drv, int reason)
+{
+    drv->stats.nr_fallbacks[reason]++;
+    return -1;
+}
+
+#ifdef RGA_HAVE_JOB_API
+static int begin_job(DrmDriver *drv)
+{
+    if (drv->job_tasks == NULL) {
+        drv->job_tasks = malloc(sizeof(*drv->job_tasks) * RGA_JOB_MAX_TASKS);
+        if (drv->job_tasks == NULL) {
+            _WRN_PRINTF("Failed to allocate the log of tasks; "
+                    "submit operations one by one\n");
+            drv->batching = false;
+            return -1;
+        }
+    }
+
+    drv->job = imbeginJob(0);
+    if (drv->job == 0) {
+        _WRN_PRINTF("Failed imbeginJob(); submit operations one by one\n");
+        drv->batching = false;
+        return -1;
+    }
+
+    drv->job_serial++;
+    drv->job_fence = -1;
+    drv->nr_job_bufs = 0;
+    drv->nr_job_tasks = 0;
+    return 0;
+}
+
+static void replay_job_tasks(DrmDriver *drv);
+
+/*
+ * Submit the pending job; its release fence goes to every buffer in it.
+ * The operations in the job were reported done already, so if the job
+ * fails, its tasks are run one by one after the fences of the buffers.
+ */
+static void end_job(DrmDriver *drv)
+{
+    int i, release_fence = -1;
+
+    if (drv->job == 0)
+        return;
+
+    IM_STATUS status = imendJob(drv->job, IM_ASYNC, drv->job_fence,
+            &release_fence);
+    if (rga_failed(status)) {
+        count_failure(drv, "imendJob()", status);
+        wait_fence(&drv->job_fence);
+        replay_job_tasks(drv);
+    }
+    if (drv->job_fence >= 0)
+        close(drv->job_fence);
+
+    for (i = 0; i < drv->nr_job_bufs; i++) {
+        my_surface_buffer *buf = drv->job_bufs[i];
+
+        buf->job_serial = 0;
+        if (release_fence >= 0)
+            set_fence(buf, dup(release_fence));
+    }
+
+    if (release_fence >= 0) {
+        int fence = merge_fences(drv->fence, release_fence);
+        if (drv->fence >= 0)
+            close(drv->fence);
+        drv->fence = fence;
+        close(release_fence);
+    }
+
+    drv->job = 0;
+    drv->job_fence = -1;
+    drv->nr_job_bufs = 0;
+    drv->nr_job_tasks = 0;
+}
+
+/*
+ * Cancel the pending job when the tasks of an operation cannot be added
+ * to it, so that the operation is not done in part; the first nr_tasks
+ * tasks, of the operations added before, are run one by one.
+ */
+static void cancel_job(DrmDriver *drv, int nr_tasks)
+{
+    int i;
+
+    imcancelJob(drv->job);
+    drv->nr_job_tasks = nr_tasks;
+    wait_fence(&drv->job_fence);
+    replay_job_tasks(drv);
+
+    for (i = 0; i < drv->nr_job_bufs; i++)
+        drv->job_bufs[i]->job_serial = 0;
+
+    drv->job = 0;
+    drv->nr_job_bufs = 0;
+    drv->nr_job_tasks = 0;
+}
+
+/* Make room in the pending job for the buffers and the tasks of an
+   operation, submitting it if full, or begin a job. */
+static int reserve_job(DrmDriver *drv, int nr_bufs, int nr_tasks)
+{
+    if (drv->job && (drv->nr_job_bufs + nr_bufs > RGA_JOB_MAX_BUFS ||
+                drv->nr_job_tasks + nr_tasks > RGA_JOB_MAX_TASKS))
+        end_job(drv);
+
+    return drv->job ? 0 : begin_job(drv);
+}
+
+/* Add a buffer to the pending job; the job waits for its fence. */
+static void add_job_buffer(DrmDriver *drv, my_surface_buffer *buf)
+{
+    if (buf->job_serial == drv->job_serial)
+        return;
+
+    if (buf->fence >= 0) {
+        int fence = merge_fences(drv->job_fence, buf->fence);
+        if (drv->job_fence >= 0)
+            close(drv->job_fence);
+        drv->job_fence = fence;
+    }
+
+    buf->job_serial = drv->job_serial;
+    drv->job_bufs[drv->nr_job_bufs++] = buf;
+}
+
+static inline bool in_pending_job(DrmDriver *drv, my_surface_buffer *buf)
+{
+    return drv->job && buf->job_serial == drv->job_serial;
+}
+
+struct rga_job;
+static int add_job_tasks(DrmDriver *drv, struct rga_job *jobs, int nr_jobs);
+#endif /* RGA_HAVE_JOB_API */
+
+/* Wait for the RGA jobs queued for the buffer. */
+static inline void sync_buffer(DrmDriver *drv, my_surface_buffer *buf)
+{
+    if (drv->executor)
+        drm_executor_wait(drv->executor, buf->exec_seqno);
+#ifdef RGA_HAVE_JOB_API
+    if (in_pending_job(drv, buf))
+        end_job(drv);
+#endif
+    wait_fence(&buf->fence);
+}
+
+static DrmSurfaceBuffer *rockchip_alloc_buffer(DrmDriver *drv,
+        uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t flags);
+static void rockchip_destroy_buffer(DrmDriver *drv, DrmSurfaceBuffer *buffer);
+static uint8_t *rockchip_map_buffer(DrmDriver *drv,
+        DrmSurfaceBuffer *buffer);
+static void rockchip_unmap_buffer(DrmDriver *drv,
+        DrmSurfaceBuffer *buffer);
+static int rockchip_fill_rect(DrmDriver *drv,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *rc, uint32_t pixel);
+static int trim_pool(DrmDriver *drv, size_t keep);
+static int dump_stats(DrmDriver *drv, FILE *fp);
+static int get_hw_stats(DrmDriver *drv, HbdDrmHwStats *stats, bool reset);
+static int set_color_space(DrmDriver *drv, DrmSurfaceBuffer *buffer,
+        int color_space);
+static int get_modifier(DrmDriver *drv, DrmSurfaceBuffer *buffer,
+        uint64_t *modifier);
+static int composite(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+        DrmSurfaceBuffer *bg_buf, const GAL_Rect *bg_rc,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+        int blend, int alpha);
+static int fill_rects(DrmDriver *drv, DrmSurfaceBuffer *dst_buf,
+        const GAL_Rect *rcs, int nr_rcs, uint32_t pixel);
+static int draw_rects(DrmDriver *drv, DrmSurfaceBuffer *dst_buf,
+        const GAL_Rect *rcs, int nr_rcs, uint32_t pixel, int thickness);
+static DrmSurfaceBuffer *rockchip_create_buffer_from_vaddr(DrmDriver *drv,
+        void *vaddr, size_t size, uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t pitch);
+static void rockchip_sync_buffer(DrmDriver *drv, DrmSurfaceBuffer *buffer);
+static int present_rotated(DrmDriver *drv,
+        DrmSurfaceBuffer *shadow_buf, DrmSurfaceBuffer *scanout_buf,
+        const GAL_Rect *rcs, int nr_rcs, int rotation);
+static int mask_blit(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc, uint32_t pixel,
+        const uint8_t *mask, int mask_pitch,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc);
+
+static DrmSurfaceBuffer *rockchip_create_atlas_page(DrmDriver *drv,
+        uint32_t drm_format, uint32_t width, uint32_t height)
+{
+    return rockchip_alloc_buffer(drv, drm_format, 0, width, height,
+            DRM_SURBUF_TYPE_OFFSCREEN);
+}
+
+static const DrmAtlasOps rockchip_atlas_ops = {
+    .create_page = rockchip_create_atlas_page,
+    .destroy_page = rockchip_destroy_buffer,
+};
+
+static const DrmDriverExtOps rockchip_ext_ops = {
+    .dump_stats = dump_stats,
+    .get_hw_stats = get_hw_stats,
+    .trim_pool = trim_pool,
+    .set_color_space = set_color_space,
+    .get_modifier = get_modifier,
+    .composite = composite,
+    .fill_rects = fill_rects,
+    .draw_rects = draw_rects,
+    .create_buffer_from_vaddr = rockchip_create_buffer_from_vaddr,
+    .destroy_buffer = rockchip_destroy_buffer,
+    .sync_buffer = rockchip_sync_buffer,
+    .present_rotated = present_rotated,
+    .mask_blit = mask_blit,
+    .map_buffer = rockchip_map_buffer,
+    .unmap_buffer = rockchip_unmap_buffer,
+};
+
+#ifdef RGA_HAVE_INTERP
+static const struct rga_interp_caps *find_interp_caps(const char *version)
+{
+    unsigned i;
+
+    for (i = 0; i < TABLESIZE(rga_interp_caps_table) - 1; i++) {
+        if (version && strstr(version, rga_interp_caps_table[i].version))
+            break;
+    }
+
+    return rga_interp_caps_table + i;
+}
+#endif
+
+/*
+ * Find the cores from the string of querystring(RGA_VERSION), which names
+ * the version of every core, like "RGA_3 | RGA_3 | RGA_2_Enhance".
+ */
+static void find_cores(DrmDriver *drv, const char *version)
+{
+    static const int rga3_cores[] = {
+        IM_SCHEDULER_RGA3_CORE0, IM_SCHEDULER_RGA3_CORE1 };
+    static const int rga2_cores[] = {
+        IM_SCHEDULER_RGA2_CORE0, RGA_SCHEDULER_RGA2_CORE1 };
+    const char *p;
+    unsigned nr_rga3 = 0, nr_rga2 = 0;
+
+    for (p = version; p && (p = strstr(p, "RGA_")); p += 4) {
+        if (p[4] == '3' && nr_rga3 < TABLESIZE(rga3_cores))
+            drv->cores[drv->nr_cores++] = rga3_cores[nr_rga3++];
+        else if (p[4] == '2' && nr_rga2 < TABLESIZE(rga2_cores))
+            drv->cores[drv->nr_cores++] = rga2_cores[nr_rga2++];
+    }
+
+    if (drv->nr_cores < 2) {
+        drv->nr_cores = 0;
+        return;
+    }
+
+    _MG_PRINTF("DRM>ROCKCHIP: scheduling RGA jobs on %d cores\n",
+            drv->nr_cores);
+}
+
 /* Create rockchip DRM userland driver. */
 static DrmDriver *rockchip_create_driver(int devfd)
 {
@@ -82,18 +759,68 @@ static DrmDriver *rockchip_create_driver(int devfd)
         return NULL;
     }
 
-#ifdef _DEBUG
-    const char *rga_info = querystring(RGA_ALL);
-    _MG_PRINTF("RGA Information:\n%s\n", rga_info);
+    const char *env = getenv("HBDDRM_RGA_VALIDATE");
+    drv->validate = env && strcmp(env, "1") == 0;
+    if (drv->validate) {
+        const char *rga_info = querystring(RGA_ALL);
+        _MG_PRINTF("RGA Information:\n%s\n", rga_info);
+    }
+
+    const char *version = querystring(RGA_VERSION);
+#ifdef RGA_HAVE_INTERP
+    drv->interp_caps = find_interp_caps(version);
 #endif
+    drv->has_rga3 = version && strstr(version, "RGA_3");
+    drv->has_rop3 = version && strstr(version, "RGA_2");
+
+#ifdef RGA_HAVE_DITHER
+    env = getenv("HBDDRM_RGA_DITHER");
+    drv->dither = drv->has_rop3 && !(env && strcmp(env, "0") == 0);
+#endif
+
+    env = getenv("HBDDRM_RGA_CORES");
+    if (!(env && strcmp(env, "0") == 0))
+        find_cores(drv, version);
 
     drv->devfd = devfd;
+    drv->fence = -1;
+    drv->atlas = drm_atlas_new(drv, &rockchip_atlas_ops);
+    drv->executor = drm_executor_new(drv);
+
+    env = getenv("HBDDRM_BO_POOL_SIZE");
+    drv->pool_max_size = (env ? (size_t)atoi(env) : RK_BO_POOL_DEFAULT_SIZE)
+        * 1024 * 1024;
+
+#ifdef RGA_HAVE_JOB_API
+    env = getenv("HBDDRM_RGA_BATCH");
+    drv->batching = (drv->executor == NULL) && !(env && strcmp(env, "0") == 0);
+    drv->job_fence = -1;
+#endif
+
+    drm_driver_register(drv, devfd, &rockchip_ext_ops);
     return drv;
 }
 
 /* Destroy rockchip DRM userland driver. */
 static void rockchip_destroy_driver(DrmDriver *drv)
 {
+    int i;
+
+    drm_driver_unregister(drv);
+    for (i = 0; i < RK_MASK_BUFS; i++) {
+        if (drv->mask_bufs[i])
+            rockchip_destroy_buffer(drv, &drv->mask_bufs[i]->base);
+    }
+    drm_executor_delete(drv->executor);
+#ifdef RGA_HAVE_JOB_API
+    end_job(drv);
+    free(drv->job_tasks);
+#endif
+    wait_fence(&drv->fence);
+    report_failures(drv, true);
+    drm_atlas_delete(drv->atlas);
+    trim_pool(drv, 0);
+
     if (drv->nr_bufs) {
         _WRN_PRINTF ("There is still %d buffers left\n", drv->nr_bufs);
     }
@@ -215,6 +942,37 @@ rockchip_format_from_drm_format(uint32_t drm_format, int* bpp, int* cpp)
             *cpp = 4;
             break;
 
+        /* For the semi-planar formats, cpp is the one of the luma plane. */
+        case DRM_FORMAT_NV12:
+            rk_format = RK_FORMAT_YCbCr_420_SP;
+            *bpp = 12;
+            *cpp = 1;
+            break;
+
+        case DRM_FORMAT_NV21:
+            rk_format = RK_FORMAT_YCrCb_420_SP;
+            *bpp = 12;
+            *cpp = 1;
+            break;
+
+        case DRM_FORMAT_NV16:
+            rk_format = RK_FORMAT_YCbCr_422_SP;
+            *bpp = 16;
+            *cpp = 1;
+            break;
+
+        case DRM_FORMAT_YUYV:
+            rk_format = RK_FORMAT_YUYV_422;
+            *bpp = 16;
+            *cpp = 2;
+            break;
+
+        case DRM_FORMAT_UYVY:
+            rk_format = RK_FORMAT_UYVY_422;
+            *bpp = 16;
+            *cpp = 2;
+            break;
+
         default:
             break;
     }
@@ -222,355 +980,478 @@ rockchip_format_from_drm_format(uint32_t drm_format, int* bpp, int* cpp)
     return rk_format;
 }
 
-static void wrap_rga_buffer(DrmDriver *drv, my_surface_buffer *buf)
+static inline bool is_yuv_format(int rk_format)
 {
-    if (drmPrimeHandleToFD(drv->devfd, buf->base.handle,
-            DRM_RDWR | DRM_CLOEXEC, &buf->base.prime_fd)) {
-        _WRN_PRINTF("DRM>ROCKCHIP: failed to get prime FD of buffer: %m.\n");
+    switch (rk_format) {
+        case RK_FORMAT_YCbCr_420_SP:
+        case RK_FORMAT_YCrCb_420_SP:
+        case RK_FORMAT_YCbCr_422_SP:
+        case RK_FORMAT_YUYV_422:
+        case RK_FORMAT_UYVY_422:
+            return true;
     }
-    else {
-        uint32_t height = buf->nr_hdr_lines + buf->base.height;
 
-        im_handle_param_t param = { (uint32_t)buf->base.width, height,
-            (uint32_t)buf->rk_format };
-        buf->rga_handle = importbuffer_fd(buf->base.prime_fd, &param);
-        if (buf->rga_handle) {
-            buf->rga_buffer = wrapbuffer_handle(buf->rga_handle,
-                    buf->base.width, height, buf->rk_format,
-                    buf->base.pitch, buf->base.height);
-        }
-        else {
-            _WRN_PRINTF("DRM>ROCKCHIP: failed importbuffer_fd(): %m.\n");
-        }
-    }
+    return false;
 }
 
-static DrmSurfaceBuffer *rockchip_create_buffer(DrmDriver *drv,
-        uint32_t drm_format, uint32_t hdr_size,
-        uint32_t width, uint32_t height, uint32_t flags)
+/* The alignment of the pitch of a YUV surface created by us, in bytes;
+   RGA wants 16-pixel aligned strides for the semi-planar formats. */
+#define RK_YUV_PITCH_ALIGN      16
+
+/*
+ * Check the size of a YUV surface: the width must be even for the chroma
+ * subsampling, and so must be the height for 4:2:0. A YUV surface has no
+ * header lines.
+ */
+static bool check_yuv_size(int rk_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height)
 {
-    my_surface_buffer *buffer = NULL;
-    int rk_format;
-    int bpp, cpp;
-    uint32_t pitch, nr_hdr_lines = 0;
-    uint32_t rk_flags;
+    if (hdr_size || (width & 1))
+        return false;
 
-    if ((flags & DRM_SURBUF_TYPE_MASK) == DRM_SURBUF_TYPE_SCANOUT) {
-        rk_flags = ROCKCHIP_BO_CONTIG;
-    }
-    else if ((flags & DRM_SURBUF_TYPE_MASK) == DRM_SURBUF_TYPE_SHADOW) {
-        rk_flags = ROCKCHIP_BO_CONTIG | ROCKCHIP_BO_CACHABLE;
-    }
-    else {
-        rk_flags = ROCKCHIP_BO_CACHABLE;
-    }
+    if ((rk_format == RK_FORMAT_YCbCr_420_SP ||
+                rk_format == RK_FORMAT_YCrCb_420_SP) && (height & 1))
+        return false;
 
-    rk_format = rockchip_format_from_drm_format(drm_format, &bpp, &cpp);
-    if (rk_format == -1) {
-        _ERR_PRINTF("DRM>ROCKCHIP: not supported format: %d\n", drm_format);
-        goto failed;
-    }
+    return true;
+}
 
-    pitch = ROUND_TO_MULTIPLE(width * cpp, 4);
-    if (hdr_size) {
-        nr_hdr_lines = hdr_size / pitch;
-        if (hdr_size % pitch)
-            nr_hdr_lines++;
-    }
+/*
+ * The whole size of a surface. The chroma plane of a semi-planar format
+ * follows the luma plane immediately, with the same pitch; it has half the
+ * lines of the luma plane for 4:2:0, and as many for 4:2:2.
+ */
+static size_t surface_size(int rk_format, uint32_t pitch,
+        uint32_t height, uint32_t nr_hdr_lines)
+{
+    switch (rk_format) {
+        case RK_FORMAT_YCbCr_420_SP:
+        case RK_FORMAT_YCrCb_420_SP:
+            return (size_t)pitch * height * 3 / 2;
 
-    size_t size = (height + nr_hdr_lines) * pitch;
-    if (size == 0) {
-        _ERR_PRINTF("DRM>ROCKCHIP: zero size requested (%u x %u)\n",
-                width, height);
-        goto failed;
+        case RK_FORMAT_YCbCr_422_SP:
+            return (size_t)pitch * height * 2;
     }
 
-    buffer = calloc(1, sizeof(*buffer));
-    if (buffer == NULL) {
-        _ERR_PRINTF ("DRM>ROCKCHIP: could not allocate surface buffer: %m\n");
-        goto failed;
-    }
+    return (size_t)pitch * (height + nr_hdr_lines);
+}
 
-    struct drm_rockchip_gem_create req = {
-        .size = size,
-        .flags = rk_flags,
-    };
+/*
+ * The layout of a buffer for RGA: the width stride is in pixels (of the
+ * luma plane), and the height stride covers the header lines, because the
+ * rectangles are offset by them in to_imrect(). Returns false if the pitch
+ * is not a multiple of the pixel size, which RGA cannot handle.
+ */
+static bool get_rga_param(const my_surface_buffer *buf,
+        im_handle_param_t *param)
+{
+    if (buf->base.pitch % buf->base.cpp)
+        return false;
+
+    param->width = buf->base.pitch / buf->base.cpp;
+    param->height = buf->nr_hdr_lines + buf->base.height;
+    if (buf->afbc)
+        param->height = ROUND_TO_MULTIPLE(param->height, RK_AFBC_BLOCK_SIZE);
+    param->format = buf->rk_format;
+    return true;
+}
 
-    if (drmIoctl(drv->devfd, DRM_IOCTL_ROCKCHIP_GEM_CREATE, &req)){
-        _ERR_PRINTF("DRM>ROCKCHIP: failed to create gem object: %m.\n");
-        goto failed;
-    }
+static inline void wrap_rga_buffer(my_surface_buffer *buf,
+        const im_handle_param_t *param)
+{
+    buf->rga_buffer = wrapbuffer_handle(buf->rga_handle,
+            buf->base.width, param->height, buf->rk_format,
+            param->width, param->height);
+#ifdef RK_HAVE_AFBC
+    if (buf->afbc)
+        buf->rga_buffer.rd_mode = IM_FBC_MODE;
+#endif
+}
 
-    buffer->base.handle = req.handle;
-    buffer->base.prime_fd = -1;
-    buffer->base.name = 0;
-    buffer->base.fb_id = 0;
-    buffer->base.drm_format = drm_format;
-    buffer->base.bpp = bpp;
-    buffer->base.cpp = cpp;
-    buffer->base.scanout = IS_SURFACE_FOR_SCANOUT(flags) ? 1 : 0;
-    buffer->base.width = width;
-    buffer->base.height = height;
-    buffer->base.pitch = pitch;
-    buffer->base.size = size;
-    buffer->base.offset = nr_hdr_lines * pitch;
-    buffer->base.buff = NULL;
-
-    buffer->nr_hdr_lines = nr_hdr_lines;
-    buffer->rk_format = rk_format;
-    buffer->rk_flags = rk_flags;
+/*
+ * The size of an AFBC surface: a 16-byte header for every superblock,
+ * then the body of every superblock, which takes the size of the
+ * uncompressed pixels at most.
+ */
+static size_t afbc_size(uint32_t width, uint32_t height, int cpp)
+{
+    size_t nr_blocks =
+        (ROUND_TO_MULTIPLE(width, RK_AFBC_BLOCK_SIZE) / RK_AFBC_BLOCK_SIZE) *
+        (ROUND_TO_MULTIPLE(height, RK_AFBC_BLOCK_SIZE) / RK_AFBC_BLOCK_SIZE);
 
-    drv->nr_bufs++;
+    return ROUND_TO_MULTIPLE(nr_blocks * 16, RK_AFBC_HEADER_ALIGN) +
+        nr_blocks * RK_AFBC_BLOCK_SIZE * RK_AFBC_BLOCK_SIZE * cpp;
+}
 
-    _DBG_PRINTF("Allocate GEM object for surface buffer: "
-            "width (%d), height (%d), (pitch: %d), size (%lu), offset (%ld)\n",
-            buffer->base.width, buffer->base.height, buffer->base.pitch,
-            buffer->base.size, buffer->base.offset);
+/* A scanout surface is created in AFBC on request (HBDDRM_SURBUF_FLAG_AFBC)
+   only, as the caller has to add the framebuffer with the modifier; and if
+   RGA3 can write it. The display controller takes the 32-bit RGB formats
+   in AFBC. */
+static bool use_afbc(DrmDriver *drv, int rk_format,
+        uint32_t hdr_size, uint32_t flags)
+{
+#ifdef RK_HAVE_AFBC
+    if ((flags & DRM_SURBUF_TYPE_MASK) != DRM_SURBUF_TYPE_SCANOUT ||
+            !(flags & HBDDRM_SURBUF_FLAG_AFBC))
+        return false;
+
+    if (!drv->has_rga3 || hdr_size) {
+        _DBG_PRINTF("DRM>ROCKCHIP: no AFBC for this scanout surface\n");
+        return false;
+    }
 
-    wrap_rga_buffer(drv, buffer);
-    return &buffer->base;
+    switch (rk_format) {
+        case RK_FORMAT_RGBA_8888:
+        case RK_FORMAT_BGRA_8888:
+        case RK_FORMAT_RGBX_8888:
+        case RK_FORMAT_BGRX_8888:
+            return true;
+    }
+#else
+    (void)drv;
+    (void)rk_format;
+    (void)hdr_size;
+    (void)flags;
+#endif
 
-failed:
-    if (buffer)
-        free(buffer);
-    return NULL;
+    return false;
 }
 
-static void rockchip_destroy_buffer(DrmDriver *drv, DrmSurfaceBuffer *buffer)
+/*
+ * Import a buffer to RGA. This is deferred to the first hardware operation
+ * on the buffer, so the surfaces only touched by the CPU never consume a
+ * prime fd or an RGA handle. A surface in an atlas page uses the import
+ * of the page.
+ */
+static bool import_rga_buffer(DrmDriver *drv, my_surface_buffer *buf)
 {
-    my_surface_buffer *mybuf = (my_surface_buffer *)buffer;
-    assert(mybuf != NULL);
+    if (buf->rga_handle)
+        return true;
+    if (buf->rga_import_failed)
+        return false;
 
-    if (mybuf->base.buff) {
-        munmap(mybuf->base.buff, mybuf->base.size);
+    if (buf->slot.page) {
+        my_surface_buffer *page = (my_surface_buffer *)buf->slot.page_buf;
+
+        if (!import_rga_buffer(drv, page)) {
+            buf->rga_import_failed = true;
+            return false;
+        }
+
+        buf->rga_handle = page->rga_handle;
+        buf->rga_buffer = page->rga_buffer;
+        return true;
     }
 
-    if (mybuf->rga_handle) {
-        releasebuffer_handle(mybuf->rga_handle);
+    im_handle_param_t param;
+    if (!get_rga_param(buf, &param)) {
+        _DBG_PRINTF("DRM>ROCKCHIP: pitch %u is not in whole pixels.\n",
+                buf->base.pitch);
+        buf->rga_import_failed = true;
+        return false;
     }
 
-    if (mybuf->base.prime_fd) {
-        close(mybuf->base.prime_fd);
+    /* the memory of the application is imported as it is */
+    if (buf->vaddr) {
+        buf->rga_handle = importbuffer_virtualaddr(buf->vaddr, &param);
+        if (buf->rga_handle == 0) {
+            _WRN_PRINTF("DRM>ROCKCHIP: failed importbuffer_virtualaddr(): "
+                    "%m.\n");
+            buf->rga_import_failed = true;
+            return false;
+        }
+
+        wrap_rga_buffer(buf, &param);
+        return true;
     }
 
-    struct drm_gem_close req = {
-        .handle = mybuf->base.handle,
-    };
+    /* the surfaces on an imported object with the same layout share the
+       RGA handle, and all share the prime fd */
+    if (buf->import) {
+        struct rockchip_import *imp = buf->import;
+
+        if (imp->rga_handle && imp->rga_param.width == param.width &&
+                imp->rga_param.height == param.height &&
+                imp->rga_param.format == param.format) {
+            buf->rga_handle = imp->rga_handle;
+            wrap_rga_buffer(buf, &param);
+            return true;
+        }
 
-    if (drmIoctl(drv->devfd, DRM_IOCTL_GEM_CLOSE, &req)) {
-        _WRN_PRINTF("Failed drmIoctl(DRM_IOCTL_GEM_CLOSE): %m\n");
+        buf->base.prime_fd = imp->prime_fd;
     }
-    else {
-        drv->nr_bufs--;
-        _DBG_PRINTF("Buffer object (%u) destroied\n", mybuf->base.handle);
+
+    /* a buffer created from a prime fd has it already */
+    if (buf->base.prime_fd < 0) {
+        if (drmPrimeHandleToFD(drv->devfd, buf->base.handle,
+                    DRM_RDWR | DRM_CLOEXEC, &buf->base.prime_fd)) {
+            _WRN_PRINTF("DRM>ROCKCHIP: failed to get prime FD of buffer: "
+                    "%m.\n");
+            buf->base.prime_fd = -1;
+            buf->rga_import_failed = true;
+            return false;
+        }
+        buf->own_prime_fd = buf->base.prime_fd;
     }
 
-    free(mybuf);
+    if (buf->import)
+        buf->import->prime_fd = buf->base.prime_fd;
+
+    buf->rga_handle = importbuffer_fd(buf->base.prime_fd, &param);
+    if (buf->rga_handle == 0) {
+        _WRN_PRINTF("DRM>ROCKCHIP: failed importbuffer_fd(): %m.\n");
+        buf->rga_import_failed = true;
+        return false;
+    }
+
+    if (buf->import && buf->import->rga_handle == 0) {
+        buf->import->rga_handle = buf->rga_handle;
+        buf->import->rga_param = param;
+    }
+
+    wrap_rga_buffer(buf, &param);
+    return true;
 }
 
-static int check_format_size(size_t size,
-        uint32_t drm_format, int *bpp, int *cpp,
-        uint32_t hdr_size, uint32_t width, uint32_t height, uint32_t pitch)
+static void release_gem_object(DrmDriver *drv, uint32_t handle,
+        int prime_fd, rga_buffer_handle_t rga_handle,
+        uint8_t *map, size_t size)
 {
-    int rk_format;
-    uint32_t nr_hdr_lines = 0;
+    if (map) {
+        munmap(map, size);
+    }
 
-    rk_format = rockchip_format_from_drm_format(drm_format, bpp, cpp);
-    if (rk_format == -1) {
-        _ERR_PRINTF("DRM>i915: not supported format: %d\n", drm_format);
-        return -1;
+    if (rga_handle) {
+        releasebuffer_handle(rga_handle);
     }
 
-    if (pitch != ROUND_TO_MULTIPLE(width * *cpp, 4)) {
-        _ERR_PRINTF("DRM>i915: bad pitch value: %u\n", pitch);
-        return -1;
+    if (prime_fd >= 0) {
+        close(prime_fd);
     }
 
-    if (hdr_size) {
-        nr_hdr_lines = hdr_size / pitch;
-        if (hdr_size % pitch)
-            nr_hdr_lines++;
+    /* a buffer created on user memory has no handle */
+    if (handle == 0)
+        return;
+
+    struct drm_gem_close req = {
+        .handle = handle,
+    };
+
+    if (drmIoctl(drv->devfd, DRM_IOCTL_GEM_CLOSE, &req)) {
+        _WRN_PRINTF("Failed drmIoctl(DRM_IOCTL_GEM_CLOSE): %m\n");
     }
+    else {
+        _DBG_PRINTF("Buffer object (%u) destroied\n", handle);
+    }
+}
 
-    if (size && size != (height + nr_hdr_lines) * pitch) {
-        _ERR_PRINTF("DRM>i915: bad size: %lu\n", (unsigned long)size);
-        return -1;
+/* Release the pooled objects until the pool is not larger than keep. */
+static int trim_pool(DrmDriver *drv, size_t keep)
+{
+    struct rockchip_pooled_bo **pprev, *bo;
+
+    /* the least recently released ones are at the tail */
+    while (drv->pool_size > keep) {
+        pprev = &drv->pool;
+        while ((*pprev)->next)
+            pprev = &(*pprev)->next;
+
+        bo = *pprev;
+        *pprev = NULL;
+        drv->pool_size -= bo->size;
+        release_gem_object(drv, bo->handle, bo->prime_fd, bo->rga_handle,
+                bo->map, bo->size);
+        free(bo);
     }
 
-    return rk_format;
+    return 0;
 }
 
-static DrmSurfaceBuffer *rockchip_create_buffer_from_handle(DrmDriver *drv,
-        uint32_t handle, size_t size,
-        uint32_t drm_format, uint32_t hdr_size,
-        uint32_t width, uint32_t height, uint32_t pitch)
+/* Keep the GEM object of a buffer being destroyed in the pool. */
+static bool put_into_pool(DrmDriver *drv, my_surface_buffer *buf)
 {
-    my_surface_buffer *buffer = NULL;
-    int rk_format;
-    int bpp, cpp;
-
-    rk_format = check_format_size(size, drm_format, &bpp, &cpp,
-            hdr_size, width, height, pitch);
-    if (rk_format == -1) {
-        _ERR_PRINTF("DRM>ROCKCHIP: bad surface parameters for handle %u: "
-                "whole size: <unknown>, header size: %u, %u x %u, pitch: %u\n",
-                handle, hdr_size, width, height, pitch);
-        return NULL;
-    }
+    struct rockchip_pooled_bo *bo;
+
+    if (!buf->recyclable || buf->base.size > drv->pool_max_size)
+        return false;
+
+    /* an object flinked, added as a framebuffer, or exported by MiniGUI
+       may still be used by another process, or by the display */
+    if (buf->base.name || buf->base.fb_id || (buf->base.prime_fd >= 0 &&
+                buf->base.prime_fd != buf->own_prime_fd))
+        return false;
+
+    bo = malloc(sizeof(*bo));
+    if (bo == NULL)
+        return false;
+
+    bo->size = buf->base.size;
+    bo->rk_flags = buf->rk_flags;
+    bo->handle = buf->base.handle;
+    bo->prime_fd = buf->base.prime_fd;
+    bo->rga_handle = buf->rga_handle;
+    if (bo->rga_handle)
+        get_rga_param(buf, &bo->rga_param);
+    bo->map = buf->map;
+
+    bo->next = drv->pool;
+    drv->pool = bo;
+    drv->pool_size += bo->size;
+    trim_pool(drv, drv->pool_max_size);
+    return true;
+}
 
-    uint32_t nr_hdr_lines = hdr_size / pitch;
+/* Take a GEM object of the size and flags from the pool for a new buffer.
+   The RGA handle is reused only if it was imported with the same layout. */
+static bool take_from_pool(DrmDriver *drv, my_surface_buffer *buf)
+{
+    struct rockchip_pooled_bo **pprev, *bo;
 
-    buffer = calloc(1, sizeof(*buffer));
-    if (buffer == NULL) {
-        _ERR_PRINTF ("DRM>ROCKCHIP: could not allocate surface buffer: %m\n");
-        goto failed;
+    for (pprev = &drv->pool; *pprev; pprev = &(*pprev)->next) {
+        bo = *pprev;
+        if (bo->size == buf->base.size && bo->rk_flags == buf->rk_flags)
+            break;
     }
 
-    buffer->base.handle = handle;
-    buffer->base.prime_fd = -1;
-    buffer->base.name = 0;
-    buffer->base.fb_id = 0;
-    buffer->base.drm_format = drm_format;
-    buffer->base.bpp = bpp;
-    buffer->base.cpp = cpp;
-    buffer->base.scanout = 0;
-    buffer->base.width = width;
-    buffer->base.height = height;
-    buffer->base.pitch = pitch;
-    buffer->base.size = size;
-    buffer->base.offset = nr_hdr_lines * pitch;
-    buffer->base.buff = NULL;
+    if (*pprev == NULL)
+        return false;
 
-    buffer->nr_hdr_lines = nr_hdr_lines;
-    buffer->rk_format = rk_format;
-    buffer->rk_flags = 0;
+    bo = *pprev;
+    *pprev = bo->next;
+    drv->pool_size -= bo->size;
 
-    drv->nr_bufs++;
+    buf->base.handle = bo->handle;
+    buf->base.prime_fd = bo->prime_fd;
+    buf->own_prime_fd = bo->prime_fd;
+    buf->map = bo->map;
 
-    _DBG_PRINTF("Create surface buffer from handle: %u; "
-            "width (%d), height (%d), (pitch: %d), size (%lu), offset (%ld)\n",
-            buffer->base.handle, buffer->base.width, buffer->base.height,
-            buffer->base.pitch, buffer->base.size, buffer->base.offset);
+    if (bo->rga_handle) {
+        im_handle_param_t param;
 
-    wrap_rga_buffer(drv, buffer);
-    return &buffer->base;
+        if (get_rga_param(buf, &param) &&
+                bo->rga_param.width == param.width &&
+                bo->rga_param.height == param.height &&
+                bo->rga_param.format == param.format) {
+            buf->rga_handle = bo->rga_handle;
+            wrap_rga_buffer(buf, &param);
+        }
+        else {
+            releasebuffer_handle(bo->rga_handle);
+        }
+    }
 
-failed:
-    if (buffer)
-        free(buffer);
-    return NULL;
+    free(bo);
+    return true;
 }
 
-static DrmSurfaceBuffer *rockchip_create_buffer_from_name(DrmDriver *drv,
-        uint32_t name, uint32_t drm_format, uint32_t hdr_size,
-        uint32_t width, uint32_t height, uint32_t pitch)
+static my_surface_buffer *create_buffer_from_atlas(DrmDriver *drv,
+        uint32_t drm_format, int bpp, int cpp,
+        uint32_t width, uint32_t height)
 {
-    my_surface_buffer *buffer = NULL;
-    int rk_format;
-    int bpp, cpp;
+    my_surface_buffer *buffer, *page;
+    DrmAtlasSlot slot;
 
-    rk_format = check_format_size(0, drm_format, &bpp, &cpp, hdr_size,
-            width, height, pitch);
-    if (rk_format == -1) {
-        _ERR_PRINTF("DRM>ROCKCHIP: bad surface parameters for name %u: "
-                "whole size: <unknown>, header size: %u, %u x %u, pitch: %u\n",
-                name, hdr_size, width, height, pitch);
+    if (drm_atlas_alloc(drv->atlas, drm_format, width, height, &slot))
         return NULL;
-    }
-
-    uint32_t nr_hdr_lines = hdr_size / pitch;
-    uint32_t size = (height + nr_hdr_lines) * pitch;
 
     buffer = calloc(1, sizeof(*buffer));
     if (buffer == NULL) {
         _ERR_PRINTF ("DRM>ROCKCHIP: could not allocate surface buffer: %m\n");
-        goto failed;
-    }
-
-    struct drm_gem_open req = {
-        .name = name,
-    };
-
-    if (drmIoctl(drv->devfd, DRM_IOCTL_GEM_OPEN, &req)) {
-        fprintf(stderr, "failed to open gem object: %m.\n");
-        goto failed;
+        drm_atlas_free(drv->atlas, &slot);
+        return NULL;
     }
 
-    buffer->base.handle = req.handle;
-    buffer->base.prime_fd = -1;
-    buffer->base.name = name;
+    page = (my_surface_buffer *)slot.page_buf;
+    buffer->base = page->base;
     buffer->base.fb_id = 0;
-    buffer->base.drm_format = drm_format;
     buffer->base.bpp = bpp;
     buffer->base.cpp = cpp;
     buffer->base.scanout = 0;
     buffer->base.width = width;
     buffer->base.height = height;
-    buffer->base.pitch = pitch;
-    buffer->base.size = size;
-    buffer->base.offset = nr_hdr_lines * pitch;
+    buffer->base.offset = slot.y * page->base.pitch + slot.x * cpp;
     buffer->base.buff = NULL;
 
-    buffer->nr_hdr_lines = nr_hdr_lines;
-    buffer->rk_format = rk_format;
-    buffer->rk_flags = 0;
+    buffer->nr_hdr_lines = 0;
+    buffer->rk_format = page->rk_format;
+    buffer->rk_flags = page->rk_flags;
+    buffer->fence = -1;
+    buffer->slot = slot;
 
     drv->nr_bufs++;
 
-    _DBG_PRINTF("Create surface buffer from name: %u; "
-            "width (%d), height (%d), (pitch: %d), size (%lu), offset (%ld)\n",
-            buffer->base.name, buffer->base.width, buffer->base.height,
-            buffer->base.pitch, buffer->base.size, buffer->base.offset);
-
-    wrap_rga_buffer(drv, buffer);
-    return &buffer->base;
-
-failed:
-    if (buffer)
-        free(buffer);
-    return NULL;
+    _DBG_PRINTF("Allocate surface buffer in atlas page (%u): "
+            "width (%d), height (%d), (pitch: %d), offset (%ld)\n",
+            buffer->base.handle, buffer->base.width, buffer->base.height,
+            buffer->base.pitch, buffer->base.offset);
+    return buffer;
 }
 
-static DrmSurfaceBuffer *rockchip_create_buffer_from_prime_fd(DrmDriver *drv,
-        int prime_fd, size_t size,
+static DrmSurfaceBuffer *rockchip_alloc_buffer(DrmDriver *drv,
         uint32_t drm_format, uint32_t hdr_size,
-        uint32_t width, uint32_t height, uint32_t pitch)
+        uint32_t width, uint32_t height, uint32_t flags)
 {
     my_surface_buffer *buffer = NULL;
     int rk_format;
     int bpp, cpp;
+    uint32_t pitch, nr_hdr_lines = 0;
+    uint32_t rk_flags;
+    bool afbc = false;
 
-    size_t file_size;
-    off_t seek = lseek (prime_fd, 0, SEEK_END);
-    if (seek != -1)
-        file_size = seek;
+    if ((flags & DRM_SURBUF_TYPE_MASK) == DRM_SURBUF_TYPE_SCANOUT) {
+        rk_flags = ROCKCHIP_BO_CONTIG;
+    }
+    else if ((flags & DRM_SURBUF_TYPE_MASK) == DRM_SURBUF_TYPE_SHADOW) {
+        rk_flags = ROCKCHIP_BO_CONTIG | ROCKCHIP_BO_CACHABLE;
+    }
     else {
-        _ERR_PRINTF("DRM>ROCKCHIP: Failed to get size of buffer from fd (%d): "
-                "%m\n", prime_fd);
+        rk_flags = ROCKCHIP_BO_CACHABLE;
+    }
+
+    rk_format = rockchip_format_from_drm_format(drm_format, &bpp, &cpp);
+    if (rk_format == -1) {
+        _ERR_PRINTF("DRM>ROCKCHIP: not supported format: %d\n", drm_format);
         goto failed;
     }
 
-    _DBG_PRINTF("File size got from lseek(): %lu\n", (unsigned long)file_size);
+    if (is_yuv_format(rk_format)) {
+        if (!check_yuv_size(rk_format, hdr_size, width, height)) {
+            _ERR_PRINTF("DRM>ROCKCHIP: bad size for YUV format %d: "
+                    "%u x %u, header size: %u\n",
+                    drm_format, width, height, hdr_size);
+            goto failed;
+        }
 
-    if (size == 0) {
-        size = file_size;
+        pitch = ROUND_TO_MULTIPLE(width * cpp, RK_YUV_PITCH_ALIGN);
     }
-    else if (size > file_size) {
-        _ERR_PRINTF("DRM>ROCKCHIP: size (%lu) doesn't match file size (%lu)\n",
-                (unsigned long)size, (unsigned long)file_size);
-        goto failed;
+    else if (use_afbc(drv, rk_format, hdr_size, flags)) {
+        afbc = true;
+        pitch = ROUND_TO_MULTIPLE(width, RK_AFBC_BLOCK_SIZE) * cpp;
     }
+    else {
+        if (drv->atlas &&
+                IS_SURFACE_FOR_ATLAS(hdr_size, width, height, flags)) {
+            buffer = create_buffer_from_atlas(drv, drm_format, bpp, cpp,
+                    width, height);
+            if (buffer)
+                return &buffer->base;
+        }
 
-    rk_format = check_format_size(size, drm_format, &bpp, &cpp, hdr_size,
-            width, height, pitch);
-    if (rk_format == -1) {
-        _ERR_PRINTF("DRM>ROCKCHIP: bad surface parameters for prime fd %d: "
-                "whole size: %lu, header size: %u, %u x %u, pitch: %u\n",
-                prime_fd, (unsigned long)size, hdr_size, width, height, pitch);
-        goto failed;
+        pitch = ROUND_TO_MULTIPLE(width * cpp, 4);
+        if (hdr_size) {
+            nr_hdr_lines = hdr_size / pitch;
+            if (hdr_size % pitch)
+                nr_hdr_lines++;
+        }
     }
 
-    uint32_t nr_hdr_lines = hdr_size / pitch;
+    size_t size = afbc ? afbc_size(width, height, cpp) :
+        surface_size(rk_format, pitch, height, nr_hdr_lines);
+    if (size == 0) {
+        _ERR_PRINTF("DRM>ROCKCHIP: zero size requested (%u x %u)\n",
+                width, height);
+        goto failed;
+    }
 
     buffer = calloc(1, sizeof(*buffer));
     if (buffer == NULL) {
@@ -578,14 +1459,38 @@ static DrmSurfaceBuffer *rockchip_create_buffer_from_prime_fd(DrmDriver *drv,
         goto failed;
     }
 
-    buffer->base.handle = 0;
-    buffer->base.prime_fd = prime_fd;
+    buffer->base.cpp = cpp;
+    buffer->base.width = width;
+    buffer->base.height = height;
+    buffer->base.pitch = pitch;
+    buffer->base.size = size;
+    buffer->nr_hdr_lines = nr_hdr_lines;
+    buffer->rk_format = rk_format;
+    buffer->rk_flags = rk_flags;
+    buffer->afbc = afbc;
+
+    if (!take_from_pool(drv, buffer)) {
+        struct drm_rockchip_gem_create req = {
+            .size = size,
+            .flags = rk_flags,
+        };
+
+        if (drmIoctl(drv->devfd, DRM_IOCTL_ROCKCHIP_GEM_CREATE, &req)){
+            _ERR_PRINTF("DRM>ROCKCHIP: failed to create gem object: %m.\n");
+            goto failed;
+        }
+
+        buffer->base.handle = req.handle;
+        buffer->base.prime_fd = -1;
+        buffer->own_prime_fd = -1;
+    }
+
     buffer->base.name = 0;
     buffer->base.fb_id = 0;
     buffer->base.drm_format = drm_format;
     buffer->base.bpp = bpp;
     buffer->base.cpp = cpp;
-    buffer->base.scanout = 0;
+    buffer->base.scanout = IS_SURFACE_FOR_SCANOUT(flags) ? 1 : 0;
     buffer->base.width = width;
     buffer->base.height = height;
     buffer->base.pitch = pitch;
@@ -595,16 +1500,19 @@ static DrmSurfaceBuffer *rockchip_create_buffer_from_prime_fd(DrmDriver *drv,
 
     buffer->nr_hdr_lines = nr_hdr_lines;
     buffer->rk_format = rk_format;
-    buffer->rk_flags = 0;
+    buffer->fence = -1;
+    buffer->rk_flags = rk_flags;
+    buffer->recyclable = true;
+    buffer->next_local = drv->local_bufs;
+    drv->local_bufs = buffer;
 
     drv->nr_bufs++;
 
-    _DBG_PRINTF("Create surface buffer from prime fd: %d; "
+    _DBG_PRINTF("Allocate GEM object for surface buffer: "
             "width (%d), height (%d), (pitch: %d), size (%lu), offset (%ld)\n",
-            buffer->base.prime_fd, buffer->base.width, buffer->base.height,
-            buffer->base.pitch, buffer->base.size, buffer->base.offset);
+            buffer->base.width, buffer->base.height, buffer->base.pitch,
+            buffer->base.size, buffer->base.offset);
 
-    wrap_rga_buffer(drv, buffer);
     return &buffer->base;
 
 failed:
@@ -613,362 +1521,2718 @@ failed:
     return NULL;
 }
 
+/* Clear a new surface with RGA, or with the CPU if RGA refuses it.
+   The pixel is an RGB one, so a YUV surface is left as it is; so is an
+   AFBC surface, which RGA3 does not fill. */
+static void clear_buffer(DrmDriver *drv, DrmSurfaceBuffer *buffer,
+        uint32_t pixel)
+{
+    GAL_Rect rc = { 0, 0, (int)buffer->width, (int)buffer->height };
+    my_surface_buffer *mybuf = (my_surface_buffer *)buffer;
+
+    if (is_yuv_format(mybuf->rk_format) || mybuf->afbc)
+        return;
+
+    if (rockchip_fill_rect(drv, buffer, &rc, pixel) == 0)
+        return;
+
+    if (rockchip_map_buffer(drv, buffer)) {
+        drm_fill_pixels(buffer->buff + buffer->offset, buffer->pitch,
+                buffer->cpp, buffer->width, buffer->height, pixel);
+        rockchip_unmap_buffer(drv, buffer);
+    }
+}
+
+static DrmSurfaceBuffer *rockchip_create_buffer(DrmDriver *drv,
+        uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t flags)
+{
+    DrmSurfaceBuffer *buffer;
+    uint32_t pixel;
+
+    buffer = rockchip_alloc_buffer(drv, drm_format, hdr_size,
+            width, height, flags);
+    if (buffer && drm_driver_clear_on_create(drv, flags, &pixel)) {
+        clear_buffer(drv, buffer, pixel);
+    }
+
+    return buffer;
+}
+
+/* Find the import of a flink name, or of the dma-buf of a prime fd. */
+static struct rockchip_import *find_import(DrmDriver *drv,
+        uint32_t name, uint32_t handle)
+{
+    struct rockchip_import *imp;
+
+    for (imp = drv->imports; imp; imp = imp->next) {
+        if (name ? imp->name == name : imp->handle == handle)
+            break;
+    }
+
+    return imp;
+}
+
+static struct rockchip_import *new_import(DrmDriver *drv,
+        uint32_t handle, int prime_fd, size_t size)
+{
+    struct rockchip_import *imp;
+
+    imp = calloc(1, sizeof(*imp));
+    if (imp == NULL) {
+        _ERR_PRINTF("DRM>ROCKCHIP: could not allocate import: %m\n");
+        return NULL;
+    }
+
+    imp->handle = handle;
+    imp->prime_fd = prime_fd;
+    imp->size = size;
+    imp->next = drv->imports;
+    drv->imports = imp;
+    return imp;
+}
+
+static void attach_import(my_surface_buffer *buf, struct rockchip_import *imp)
+{
+    imp->nr_refs++;
+    buf->import = imp;
+    buf->base.handle = imp->handle;
+    buf->base.prime_fd = imp->prime_fd;
+    buf->map = imp->map;
+}
+
+/* Release an imported object when the last surface on it is destroyed. */
+static void detach_import(DrmDriver *drv, my_surface_buffer *buf)
+{
+    struct rockchip_import **pprev, *imp = buf->import;
+
+    if (buf->rga_handle && buf->rga_handle != imp->rga_handle)
+        releasebuffer_handle(buf->rga_handle);
+
+    buf->import = NULL;
+    if (--imp->nr_refs)
+        return;
+
+    for (pprev = &drv->imports; *pprev != imp; pprev = &(*pprev)->next)
+        ;
+    *pprev = imp->next;
+
+    release_gem_object(drv, imp->handle, imp->prime_fd, imp->rga_handle,
+            imp->map, imp->size);
+    free(imp);
+}
+
+static void unlink_local_buffer(DrmDriver *drv, my_surface_buffer *buf)
+{
+    my_surface_buffer **pprev;
+
+    for (pprev = &drv->local_bufs; *pprev != buf; pprev = &(*pprev)->next_local)
+        ;
+    *pprev = buf->next_local;
+}
+
+/*
+ * The kernel gives the handle of our own GEM object for a dma-buf exported
+ * by us, so a prime fd may be the one of a live buffer, or of an object in
+ * the pool. Such an object is turned into an import, which then owns the
+ * handle, the prime fd, the RGA handle and the mapping of it.
+ */
+static my_surface_buffer *find_local_buffer(DrmDriver *drv, uint32_t handle)
+{
+    my_surface_buffer *buf;
+
+    for (buf = drv->local_bufs; buf; buf = buf->next_local) {
+        if (buf->base.handle == handle)
+            break;
+    }
+
+    return buf;
+}
+
+static struct rockchip_pooled_bo **find_pooled_bo(DrmDriver *drv,
+        uint32_t handle)
+{
+    struct rockchip_pooled_bo **pprev;
+
+    for (pprev = &drv->pool; *pprev; pprev = &(*pprev)->next) {
+        if ((*pprev)->handle == handle)
+            return pprev;
+    }
+
+    return NULL;
+}
+
+/* Share the GEM object of a live buffer with the surfaces imported on it;
+   the buffer is no longer recycled. */
+static struct rockchip_import *share_local_buffer(DrmDriver *drv,
+        my_surface_buffer *buf)
+{
+    struct rockchip_import *imp;
+
+    imp = new_import(drv, buf->base.handle, buf->base.prime_fd,
+            buf->base.size);
+    if (imp == NULL)
+        return NULL;
+
+    imp->map = buf->map;
+    if (buf->rga_handle && get_rga_param(buf, &imp->rga_param))
+        imp->rga_handle = buf->rga_handle;
+
+    unlink_local_buffer(drv, buf);
+    buf->recyclable = false;
+    imp->nr_refs = 1;
+    buf->import = imp;
+    return imp;
+}
+
+static struct rockchip_import *take_pooled_bo(DrmDriver *drv,
+        struct rockchip_pooled_bo **pprev)
+{
+    struct rockchip_pooled_bo *bo = *pprev;
+    struct rockchip_import *imp;
+
+    imp = new_import(drv, bo->handle, bo->prime_fd, bo->size);
+    if (imp == NULL)
+        return NULL;
+
+    imp->map = bo->map;
+    imp->rga_handle = bo->rga_handle;
+    imp->rga_param = bo->rga_param;
+
+    *pprev = bo->next;
+    drv->pool_size -= bo->size;
+    free(bo);
+    return imp;
+}
+
+static void rockchip_destroy_buffer(DrmDriver *drv, DrmSurfaceBuffer *buffer)
+{
+    my_surface_buffer *mybuf = (my_surface_buffer *)buffer;
+    assert(mybuf != NULL);
+
+    sync_buffer(drv, mybuf);
+
+    if (mybuf->base.buff) {
+        rockchip_unmap_buffer(drv, buffer);
+    }
+
+    if (mybuf->slot.page) {
+        drm_atlas_free(drv->atlas, &mybuf->slot);
+        drv->nr_bufs--;
+        free(mybuf);
+        return;
+    }
+
+    if (mybuf->import) {
+        detach_import(drv, mybuf);
+    }
+    else {
+        if (mybuf->recyclable)
+            unlink_local_buffer(drv, mybuf);
+        if (!put_into_pool(drv, mybuf))
+            release_gem_object(drv, mybuf->base.handle, mybuf->base.prime_fd,
+                    mybuf->rga_handle, mybuf->map, mybuf->base.size);
+    }
+
+    drv->nr_bufs--;
+    free(mybuf);
+}
+
+static int check_format_size(size_t size,
+        uint32_t drm_format, int *bpp, int *cpp,
+        uint32_t hdr_size, uint32_t width, uint32_t height, uint32_t pitch)
+{
+    int rk_format;
+    uint32_t nr_hdr_lines = 0;
+
+    rk_format = rockchip_format_from_drm_format(drm_format, bpp, cpp);
+    if (rk_format == -1) {
+        _ERR_PRINTF("DRM>i915: not supported format: %d\n", drm_format);
+        return -1;
+    }
+
+    /* The video frames come with the pitch chosen by the decoder; the size
+       may have room for the padding lines of the decoder as well. */
+    if (is_yuv_format(rk_format)) {
+        if (!check_yuv_size(rk_format, hdr_size, width, height) ||
+                pitch < width * *cpp || pitch % 4) {
+            _ERR_PRINTF("DRM>ROCKCHIP: bad layout for YUV format %d: "
+                    "%u x %u, pitch: %u\n", drm_format, width, height, pitch);
+            return -1;
+        }
+
+        if (size && size < surface_size(rk_format, pitch, height, 0)) {
+            _ERR_PRINTF("DRM>ROCKCHIP: bad size: %lu\n",
+                    (unsigned long)size);
+            return -1;
+        }
+
+        return rk_format;
+    }
+
+    if (pitch != ROUND_TO_MULTIPLE(width * *cpp, 4)) {
+        _ERR_PRINTF("DRM>i915: bad pitch value: %u\n", pitch);
+        return -1;
+    }
+
+    if (hdr_size) {
+        nr_hdr_lines = hdr_size / pitch;
+        if (hdr_size % pitch)
+            nr_hdr_lines++;
+    }
+
+    if (size && size != (height + nr_hdr_lines) * pitch) {
+        _ERR_PRINTF("DRM>i915: bad size: %lu\n", (unsigned long)size);
+        return -1;
+    }
+
+    return rk_format;
+}
+
+static DrmSurfaceBuffer *rockchip_create_buffer_from_handle(DrmDriver *drv,
+        uint32_t handle, size_t size,
+        uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t pitch)
+{
+    my_surface_buffer *buffer = NULL;
+    int rk_format;
+    int bpp, cpp;
+
+    rk_format = check_format_size(size, drm_format, &bpp, &cpp,
+            hdr_size, width, height, pitch);
+    if (rk_format == -1) {
+        _ERR_PRINTF("DRM>ROCKCHIP: bad surface parameters for handle %u: "
+                "whole size: <unknown>, header size: %u, %u x %u, pitch: %u\n",
+                handle, hdr_size, width, height, pitch);
+        return NULL;
+    }
+
+    uint32_t nr_hdr_lines = hdr_size / pitch;
+
+    buffer = calloc(1, sizeof(*buffer));
+    if (buffer == NULL) {
+        _ERR_PRINTF ("DRM>ROCKCHIP: could not allocate surface buffer: %m\n");
+        goto failed;
+    }
+
+    buffer->base.handle = handle;
+    buffer->base.prime_fd = -1;
+    buffer->base.name = 0;
+    buffer->base.fb_id = 0;
+    buffer->base.drm_format = drm_format;
+    buffer->base.bpp = bpp;
+    buffer->base.cpp = cpp;
+    buffer->base.scanout = 0;
+    buffer->base.width = width;
+    buffer->base.height = height;
+    buffer->base.pitch = pitch;
+    buffer->base.size = size;
+    buffer->base.offset = nr_hdr_lines * pitch;
+    buffer->base.buff = NULL;
+
+    buffer->nr_hdr_lines = nr_hdr_lines;
+    buffer->rk_format = rk_format;
+    buffer->fence = -1;
+    buffer->rk_flags = 0;
+
+    drv->nr_bufs++;
+
+    _DBG_PRINTF("Create surface buffer from handle: %u; "
+            "width (%d), height (%d), (pitch: %d), size (%lu), offset (%ld)\n",
+            buffer->base.handle, buffer->base.width, buffer->base.height,
+            buffer->base.pitch, buffer->base.size, buffer->base.offset);
+
+    return &buffer->base;
+
+failed:
+    if (buffer)
+        free(buffer);
+    return NULL;
+}
+
+static DrmSurfaceBuffer *rockchip_create_buffer_from_name(DrmDriver *drv,
+        uint32_t name, uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t pitch)
+{
+    my_surface_buffer *buffer = NULL;
+    int rk_format;
+    int bpp, cpp;
+
+    rk_format = check_format_size(0, drm_format, &bpp, &cpp, hdr_size,
+            width, height, pitch);
+    if (rk_format == -1) {
+        _ERR_PRINTF("DRM>ROCKCHIP: bad surface parameters for name %u: "
+                "whole size: <unknown>, header size: %u, %u x %u, pitch: %u\n",
+                name, hdr_size, width, height, pitch);
+        return NULL;
+    }
+
+    uint32_t nr_hdr_lines = hdr_size / pitch;
+    size_t size = surface_size(rk_format, pitch, height, nr_hdr_lines);
+
+    buffer = calloc(1, sizeof(*buffer));
+    if (buffer == NULL) {
+        _ERR_PRINTF ("DRM>ROCKCHIP: could not allocate surface buffer: %m\n");
+        goto failed;
+    }
+
+    /* one handle is kept per name; GEM_OPEN creates a new one every call */
+    struct rockchip_import *imp = find_import(drv, name, 0);
+    if (imp == NULL) {
+        struct drm_gem_open req = {
+            .name = name,
+        };
+
+        if (drmIoctl(drv->devfd, DRM_IOCTL_GEM_OPEN, &req)) {
+            fprintf(stderr, "failed to open gem object: %m.\n");
+            goto failed;
+        }
+
+        imp = new_import(drv, req.handle, -1, req.size);
+        if (imp == NULL) {
+            release_gem_object(drv, req.handle, -1, 0, NULL, 0);
+            goto failed;
+        }
+        imp->name = name;
+    }
+
+    attach_import(buffer, imp);
+    if (size > imp->size) {
+        _ERR_PRINTF("DRM>ROCKCHIP: size (%lu) doesn't match object size (%lu)\n",
+                (unsigned long)size, (unsigned long)imp->size);
+        detach_import(drv, buffer);
+        goto failed;
+    }
+    buffer->base.name = name;
+    buffer->base.fb_id = 0;
+    buffer->base.drm_format = drm_format;
+    buffer->base.bpp = bpp;
+    buffer->base.cpp = cpp;
+    buffer->base.scanout = 0;
+    buffer->base.width = width;
+    buffer->base.height = height;
+    buffer->base.pitch = pitch;
+    buffer->base.size = size;
+    buffer->base.offset = nr_hdr_lines * pitch;
+    buffer->base.buff = NULL;
+
+    buffer->nr_hdr_lines = nr_hdr_lines;
+    buffer->rk_format = rk_format;
+    buffer->fence = -1;
+    buffer->rk_flags = 0;
+
+    drv->nr_bufs++;
+
+    _DBG_PRINTF("Create surface buffer from name: %u; "
+            "width (%d), height (%d), (pitch: %d), size (%lu), offset (%ld)\n",
+            buffer->base.name, buffer->base.width, buffer->base.height,
+            buffer->base.pitch, buffer->base.size, buffer->base.offset);
+
+    return &buffer->base;
+
+failed:
+    if (buffer)
+        free(buffer);
+    return NULL;
+}
+
+static DrmSurfaceBuffer *rockchip_create_buffer_from_prime_fd(DrmDriver *drv,
+        int prime_fd, size_t size,
+        uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t pitch)
+{
+    my_surface_buffer *buffer = NULL, *local = NULL;
+    struct rockchip_pooled_bo **pooled = NULL;
+    struct rockchip_import *imp = NULL;
+    uint32_t handle = 0;
+    int rk_format;
+    int bpp, cpp;
+
+    /* one handle is kept per dma-buf; the kernel gives the one got before
+       for a dma-buf imported or exported by us already */
+    if (drmPrimeFDToHandle(drv->devfd, prime_fd, &handle)) {
+        _ERR_PRINTF("DRM>ROCKCHIP: Failed drmPrimeFDToHandle() on fd (%d): "
+                "%m\n", prime_fd);
+        goto failed;
+    }
+
+    size_t file_size;
+    imp = find_import(drv, 0, handle);
+    if (imp == NULL) {
+        local = find_local_buffer(drv, handle);
+        if (local == NULL)
+            pooled = find_pooled_bo(drv, handle);
+    }
+
+    if (imp)
+        file_size = imp->size;
+    else {
+        off_t seek = lseek (prime_fd, 0, SEEK_END);
+        if (seek != -1)
+            file_size = seek;
+        else {
+            _ERR_PRINTF("DRM>ROCKCHIP: Failed to get size of buffer from fd "
+                    "(%d): %m\n", prime_fd);
+            goto failed;
+        }
+
+        _DBG_PRINTF("File size got from lseek(): %lu\n",
+                (unsigned long)file_size);
+    }
+
+    if (size == 0) {
+        size = file_size;
+    }
+    else if (size > file_size) {
+        _ERR_PRINTF("DRM>ROCKCHIP: size (%lu) doesn't match file size (%lu)\n",
+                (unsigned long)size, (unsigned long)file_size);
+        goto failed;
+    }
+
+    rk_format = check_format_size(size, drm_format, &bpp, &cpp, hdr_size,
+            width, height, pitch);
+    if (rk_format == -1) {
+        _ERR_PRINTF("DRM>ROCKCHIP: bad surface parameters for prime fd %d: "
+                "whole size: %lu, header size: %u, %u x %u, pitch: %u\n",
+                prime_fd, (unsigned long)size, hdr_size, width, height, pitch);
+        goto failed;
+    }
+
+    uint32_t nr_hdr_lines = hdr_size / pitch;
+
+    buffer = calloc(1, sizeof(*buffer));
+    if (buffer == NULL) {
+        _ERR_PRINTF ("DRM>ROCKCHIP: could not allocate surface buffer: %m\n");
+        goto failed;
+    }
+
+    if (imp == NULL) {
+        if (local)
+            imp = share_local_buffer(drv, local);
+        else if (pooled)
+            imp = take_pooled_bo(drv, pooled);
+        else
+            imp = new_import(drv, handle, -1, file_size);
+        if (imp == NULL)
+            goto failed;
+    }
+
+    if (imp->prime_fd < 0) {
+        /* the import has no fd yet; the fd is given to us */
+        imp->prime_fd = prime_fd;
+    }
+    else if (prime_fd != imp->prime_fd) {
+        /* the fd is given to us, and the one of the import is kept */
+        close(prime_fd);
+    }
+
+    attach_import(buffer, imp);
+    buffer->base.name = 0;
+    buffer->base.fb_id = 0;
+    buffer->base.drm_format = drm_format;
+    buffer->base.bpp = bpp;
+    buffer->base.cpp = cpp;
+    buffer->base.scanout = 0;
+    buffer->base.width = width;
+    buffer->base.height = height;
+    buffer->base.pitch = pitch;
+    buffer->base.size = size;
+    buffer->base.offset = nr_hdr_lines * pitch;
+    buffer->base.buff = NULL;
+
+    buffer->nr_hdr_lines = nr_hdr_lines;
+    buffer->rk_format = rk_format;
+    buffer->fence = -1;
+    buffer->rk_flags = 0;
+
+    drv->nr_bufs++;
+
+    _DBG_PRINTF("Create surface buffer from prime fd: %d; "
+            "width (%d), height (%d), (pitch: %d), size (%lu), offset (%ld)\n",
+            buffer->base.prime_fd, buffer->base.width, buffer->base.height,
+            buffer->base.pitch, buffer->base.size, buffer->base.offset);
+
+    return &buffer->base;
+
+failed:
+    /* the handle of an import, a live buffer, or a pooled object is kept */
+    if (handle && imp == NULL && local == NULL && pooled == NULL)
+        release_gem_object(drv, handle, -1, 0, NULL, 0);
+    if (buffer)
+        free(buffer);
+    return NULL;
+}
+
+/*
+ * Create a buffer on the memory of the application; RGA imports it by the
+ * virtual address, and the CPU accesses it directly. The buffer has no GEM
+ * object.
+ */
+static DrmSurfaceBuffer *rockchip_create_buffer_from_vaddr(DrmDriver *drv,
+        void *vaddr, size_t size, uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t pitch)
+{
+    my_surface_buffer *buffer = NULL;
+    int rk_format;
+    int bpp, cpp;
+
+    rk_format = check_format_size(size, drm_format, &bpp, &cpp, hdr_size,
+            width, height, pitch);
+    if (rk_format == -1) {
+        _ERR_PRINTF("DRM>ROCKCHIP: bad surface parameters for address %p: "
+                "whole size: %lu, header size: %u, %u x %u, pitch: %u\n",
+                vaddr, (unsigned long)size, hdr_size, width, height, pitch);
+        return NULL;
+    }
+
+    uint32_t nr_hdr_lines = hdr_size / pitch;
+    if (size == 0)
+        size = surface_size(rk_format, pitch, height, nr_hdr_lines);
+
+    buffer = calloc(1, sizeof(*buffer));
+    if (buffer == NULL) {
+        _ERR_PRINTF ("DRM>ROCKCHIP: could not allocate surface buffer: %m\n");
+        return NULL;
+    }
+
+    buffer->base.handle = 0;
+    buffer->base.prime_fd = -1;
+    buffer->base.name = 0;
+    buffer->base.fb_id = 0;
+    buffer->base.drm_format = drm_format;
+    buffer->base.bpp = bpp;
+    buffer->base.cpp = cpp;
+    buffer->base.scanout = 0;
+    buffer->base.width = width;
+    buffer->base.height = height;
+    buffer->base.pitch = pitch;
+    buffer->base.size = size;
+    buffer->base.offset = nr_hdr_lines * pitch;
+    buffer->base.buff = NULL;
+
+    buffer->nr_hdr_lines = nr_hdr_lines;
+    buffer->rk_format = rk_format;
+    buffer->fence = -1;
+    buffer->rk_flags = 0;
+    buffer->vaddr = vaddr;
+
+    drv->nr_bufs++;
+
+    _DBG_PRINTF("Create surface buffer from address: %p; "
+            "width (%d), height (%d), (pitch: %d), size (%lu), offset (%ld)\n",
+            vaddr, buffer->base.width, buffer->base.height,
+            buffer->base.pitch, buffer->base.size, buffer->base.offset);
+
+    return &buffer->base;
+}
+
+static void rockchip_sync_buffer(DrmDriver *drv, DrmSurfaceBuffer *buffer)
+{
+    sync_buffer(drv, (my_surface_buffer *)buffer);
+}
+
 extern void *mmap64(void *addr, size_t len, int prot, int flags,
         int fildes, uint64_t off);
 
-static uint8_t *rockchip_map_buffer(DrmDriver *drv,
-        DrmSurfaceBuffer *buffer)
+/* Create the persistent mapping of a buffer which owns its GEM object. */
+static uint8_t *map_gem_object(DrmDriver *drv, my_surface_buffer *buf,
+        size_t size)
+{
+    uint8_t *map;
+
+    if (buf->base.prime_fd >= 0) {
+        map = mmap(0, size,
+                PROT_READ | PROT_WRITE, MAP_SHARED, buf->base.prime_fd, 0);
+    }
+    else {
+        struct drm_rockchip_gem_map_off req = {
+            .handle = buf->base.handle,
+        };
+
+        if (drmIoctl(drv->devfd, DRM_IOCTL_ROCKCHIP_GEM_MAP_OFFSET, &req)) {
+            _ERR_PRINTF("failed to ioctl gem map offset: %m.\n");
+            return NULL;
+        }
+
+        map = mmap64(0, size, PROT_READ | PROT_WRITE,
+               MAP_SHARED, drv->devfd, req.offset);
+    }
+
+    if (map == MAP_FAILED) {
+        _ERR_PRINTF("failed to mmap buffer: %m.\n");
+        return NULL;
+    }
+
+    return map;
+}
+
+/* Get the persistent mapping of the GEM object of a buffer: the mapping of
+   the page for a surface in an atlas page, or the mapping of the whole
+   object for a surface on an imported object. */
+static uint8_t *get_mapping(DrmDriver *drv, my_surface_buffer *buf)
+{
+    my_surface_buffer *owner = buf;
+
+    if (buf->slot.page)
+        owner = (my_surface_buffer *)buf->slot.page_buf;
+
+    if (owner->map)
+        return owner->map;
+
+    if (buf->import) {
+        if (buf->import->map == NULL)
+            buf->import->map = map_gem_object(drv, buf, buf->import->size);
+        buf->map = buf->import->map;
+    }
+    else {
+        owner->map = map_gem_object(drv, owner, owner->base.size);
+    }
+
+    return owner->map;
+}
+
+/* A cacheable buffer needs the cache maintenance around the CPU access;
+   it is done through the dma-buf, which is exported for it. */
+static void sync_cpu_access(DrmDriver *drv, my_surface_buffer *buf,
+        uint64_t flags)
+{
+    if (buf->slot.page)
+        buf = (my_surface_buffer *)buf->slot.page_buf;
+
+    if (!(buf->rk_flags & ROCKCHIP_BO_CACHABLE))
+        return;
+
+    if (buf->base.prime_fd < 0) {
+        if (drmPrimeHandleToFD(drv->devfd, buf->base.handle,
+                    DRM_RDWR | DRM_CLOEXEC, &buf->base.prime_fd)) {
+            _WRN_PRINTF("DRM>ROCKCHIP: failed to get prime FD of buffer: "
+                    "%m.\n");
+            buf->base.prime_fd = -1;
+            return;
+        }
+        buf->own_prime_fd = buf->base.prime_fd;
+    }
+
+    struct dma_buf_sync req = { .flags = flags | DMA_BUF_SYNC_RW };
+    while (ioctl(buf->base.prime_fd, DMA_BUF_IOCTL_SYNC, &req) < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            _WRN_PRINTF("Failed DMA_BUF_IOCTL_SYNC: %m\n");
+            break;
+        }
+    }
+}
+
+static uint8_t *rockchip_map_buffer(DrmDriver *drv,
+        DrmSurfaceBuffer *buffer)
+{
+    my_surface_buffer *mybuf = (my_surface_buffer *)buffer;
+
+    assert(buffer->buff == NULL);
+
+    if (mybuf->afbc) {
+        _DBG_PRINTF("DRM>ROCKCHIP: an AFBC surface cannot be mapped\n");
+        return NULL;
+    }
+
+    if (mybuf->vaddr) {
+        sync_buffer(drv, mybuf);
+        buffer->buff = mybuf->vaddr;
+        return buffer->buff;
+    }
+
+    sync_buffer(drv, mybuf);
+
+    uint8_t *map = get_mapping(drv, mybuf);
+    if (map == NULL)
+        return NULL;
+
+    sync_cpu_access(drv, mybuf, DMA_BUF_SYNC_START);
+    buffer->buff = map;
+    return buffer->buff;
+}
+
+/* The mapping is kept until the buffer is destroyed. */
+static void rockchip_unmap_buffer(DrmDriver *drv,
+        DrmSurfaceBuffer *buffer)
+{
+    assert(buffer->buff);
+
+    sync_cpu_access(drv, (my_surface_buffer *)buffer, DMA_BUF_SYNC_END);
+    buffer->buff = NULL;
+}
+
+#ifdef RGA_HAVE_DITHER
+static int get_hal_transform(int usage)
+{
+    switch (usage & IM_HAL_TRANSFORM_MASK) {
+        case IM_HAL_TRANSFORM_ROT_90:
+            return HAL_TRANSFORM_ROT_90;
+        case IM_HAL_TRANSFORM_ROT_180:
+        case IM_HAL_TRANSFORM_FLIP_H_V:
+            return HAL_TRANSFORM_ROT_180;
+        case IM_HAL_TRANSFORM_ROT_270:
+            return HAL_TRANSFORM_ROT_270;
+        case IM_HAL_TRANSFORM_FLIP_H:
+            return HAL_TRANSFORM_FLIP_H;
+        case IM_HAL_TRANSFORM_FLIP_V:
+            return HAL_TRANSFORM_FLIP_V;
+    }
+
+    return 0;
+}
+
+/* Run a dithered copy as im2d would run it. The enable bit turns on the
+   ordered dither of RGA2 into a destination of lower depth, like RGB565;
+   the mode and the LUTs are for the grayscale (Y4) destinations only, and
+   are left zero. RGA3 does not dither, so the job goes to an RGA2 core
+   even if schedule_job() assigned none. */
+static IM_STATUS run_dithered_job(struct rga_job *job,
+        int acquire_fence, int *release_fence)
+{
+    rga_info_t src, dst;
+
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    src.fd = -1;
+    src.handle = job->src.handle;
+    src.mmuFlag = 1;
+    src.rotation = get_hal_transform(job->usage);
+    src.sync_mode = (job->usage & IM_ASYNC) ? RGA_BLIT_ASYNC : RGA_BLIT_SYNC;
+    rga_set_rect(&src.rect, job->src_rect.x, job->src_rect.y,
+            job->src_rect.width, job->src_rect.height,
+            job->src.wstride, job->src.hstride, job->src.format);
+
+    dst.fd = -1;
+    dst.handle = job->dst.handle;
+    dst.mmuFlag = 1;
+    dst.core = (job->opt.core & ~RGA3_CORES) ?
+        job->opt.core : IM_SCHEDULER_RGA2_CORE0;
+    dst.in_fence_fd = acquire_fence;
+    dst.dither.enable = 1;
+    rga_set_rect(&dst.rect, job->dst_rect.x, job->dst_rect.y,
+            job->dst_rect.width, job->dst_rect.height,
+            job->dst.wstride, job->dst.hstride, job->dst.format);
+
+    if (c_RkRgaBlit(&src, &dst, NULL)) {
+        return IM_STATUS_FAILED;
+    }
+
+    if (release_fence)
+        *release_fence = (job->usage & IM_ASYNC) ? dst.out_fence_fd : -1;
+    return IM_STATUS_SUCCESS;
+}
+#endif
+
+static IM_STATUS run_rga_job(struct rga_job *job,
+        int acquire_fence, int *release_fence)
+{
+#ifdef RGA_HAVE_DITHER
+    if (job->dither)
+        return run_dithered_job(job, acquire_fence, release_fence);
+#endif
+
+    return improcess(job->src, job->dst, job->pat,
+            job->src_rect, job->dst_rect, job->pat_rect,
+            acquire_fence, release_fence, &job->opt, job->usage);
+}
+
+/* Run jobs synchronously, in order. This finishes an operation of which a
+   part is done already, so a job which fails is counted and skipped: the
+   operation cannot be left to the CPU any more. */
+static void run_jobs_sync(DrmDriver *drv, struct rga_job *jobs, int nr_jobs,
+        int acquire_fence)
+{
+    int i;
+
+    for (i = 0; i < nr_jobs; i++) {
+        jobs[i].usage = (jobs[i].usage & ~IM_ASYNC) | IM_SYNC;
+        IM_STATUS status = run_rga_job(jobs + i, acquire_fence, NULL);
+        if (rga_failed(status))
+            count_failure(drv, "improcess()", status);
+    }
+}
+
+#ifdef RGA_HAVE_JOB_API
+/* Add the jobs of an operation to the pending job as tasks; the room for
+   them was reserved by reserve_job(). If one cannot be added, the job is
+   cancelled: the operation is left to the CPU if none of its tasks was
+   added, or else its tasks run synchronously with the others. */
+static int add_job_tasks(DrmDriver *drv, struct rga_job *jobs, int nr_jobs)
+{
+    int i, nr_tasks = drv->nr_job_tasks;
+
+    for (i = 0; i < nr_jobs; i++) {
+        IM_STATUS status = improcessTask(drv->job,
+                jobs[i].src, jobs[i].dst, jobs[i].pat,
+                jobs[i].src_rect, jobs[i].dst_rect, jobs[i].pat_rect,
+                &jobs[i].opt, jobs[i].usage);
+        if (rga_failed(status)) {
+            count_failure(drv, "improcessTask()", status);
+            if (i == 0) {
+                cancel_job(drv, nr_tasks);
+                return -1;
+            }
+
+            cancel_job(drv, drv->nr_job_tasks);
+            run_jobs_sync(drv, jobs + i, nr_jobs - i, -1);
+            return 0;
+        }
+
+        drv->job_tasks[drv->nr_job_tasks++] = jobs[i];
+    }
+
+    return 0;
+}
+
+/* Log a fill added to the pending job by imfillTaskArray(). */
+static void log_fill_task(DrmDriver *drv, const my_surface_buffer *dst,
+        im_rect rect, uint32_t pixel)
+{
+    struct rga_job *task = drv->job_tasks + drv->nr_job_tasks++;
+
+    memset(task, 0, sizeof(*task));
+    task->dst = dst->rga_buffer;
+    task->dst_rect = rect;
+    task->opt.color = pixel;
+    task->usage = IM_COLOR_FILL;
+}
+
+/* Run the tasks of a failed job synchronously, in order. */
+static void replay_job_tasks(DrmDriver *drv)
+{
+    run_jobs_sync(drv, drv->job_tasks, drv->nr_job_tasks, -1);
+}
+#endif
+
+/* Run a job in the executor thread, which times it. */
+static void run_queued_job(DrmDriver *drv, void *data)
+{
+    struct rga_job *job = data;
+    uint64_t start = get_time_ns();
+
+    IM_STATUS status = run_rga_job(job, -1, NULL);
+    if (rga_failed(status)) {
+        atomic_store(&drv->exec_status, status);
+        atomic_fetch_add(&drv->exec_failures, 1);
+        return;
+    }
+
+    atomic_fetch_add(&drv->exec_time_ns, get_time_ns() - start);
+    atomic_fetch_add(&drv->exec_timed_jobs, 1);
+}
+
+/* The operation of a job, for the counters. */
+static int job_op(const struct rga_job *job)
+{
+    if (job->usage & IM_COLOR_FILL)
+        return HBDDRM_OP_FILL;
+    if (job->pat_rect.width)
+        return HBDDRM_OP_COMPOSITE;
+    if (job->dither)
+        return HBDDRM_OP_DITHER;
+    if (job->usage & IM_ROP)
+        return HBDDRM_OP_ROP;
+    if (job->usage & IM_HAL_TRANSFORM_MASK)
+        return HBDDRM_OP_ROTATE;
+    if ((job->usage & (IM_ALPHA_BLEND_MASK & ~IM_ALPHA_BLEND_SRC)) ||
+            (job->usage & IM_ALPHA_COLORKEY_MASK))
+        return HBDDRM_OP_BLEND;
+    if (job->src_rect.width != job->dst_rect.width ||
+            job->src_rect.height != job->dst_rect.height)
+        return HBDDRM_OP_SCALE;
+    return HBDDRM_OP_COPY;
+}
+
+static inline uint64_t rect_bytes(const my_surface_buffer *buf,
+        const im_rect *rc)
+{
+    return (uint64_t)rc->width * rc->height * buf->base.bpp / 8;
+}
+
+/* Count the jobs of an operation which writes dst and reads src and pat. */
+static void count_jobs(DrmDriver *drv, const my_surface_buffer *src,
+        const my_surface_buffer *pat, const my_surface_buffer *dst,
+        const struct rga_job *jobs, int nr_jobs)
+{
+    int i;
+
+    drv->stats.nr_ops[job_op(jobs)]++;
+    drv->stats.nr_jobs += nr_jobs;
+    for (i = 0; i < nr_jobs; i++) {
+        drv->stats.nr_bytes += rect_bytes(dst, &jobs[i].dst_rect);
+        if (src)
+            drv->stats.nr_bytes += rect_bytes(src, &jobs[i].src_rect);
+        if (pat)
+            drv->stats.nr_bytes += rect_bytes(pat, &jobs[i].pat_rect);
+    }
+}
+
+/*
+ * Submit the jobs of an operation which writes dst and reads src and pat
+ * (if not NULL); there are several if the operation is split into bands.
+ * With the executor, the jobs are queued and run synchronously in the
+ * executor thread. In the batching mode, they are added as tasks to the
+ * pending job; but a dithered copy cannot be a task of a job, and runs after
+ * the pending job. Otherwise, they are submitted asynchronously: they wait for
+ * the fences of all buffers in the kernel, and their merged release fence
+ * becomes the fence of all. Once a job is submitted, the operation does not
+ * fail: the jobs left run synchronously if one cannot be submitted.
+ */
+static int rga_submit(DrmDriver *drv, my_surface_buffer *src,
+        my_surface_buffer *pat, my_surface_buffer *dst,
+        struct rga_job *jobs, int nr_jobs)
+{
+    int i;
+
+    count_jobs(drv, src, pat, dst, jobs, nr_jobs);
+    if (drv->executor) {
+        STATIC_ASSERT(sizeof(*jobs) <= DRM_EXECUTOR_MAX_DATA);
+
+        for (i = 0; i < nr_jobs; i++) {
+            jobs[i].usage |= IM_SYNC;
+            dst->exec_seqno = drm_executor_submit(drv->executor,
+                    run_queued_job, jobs + i, sizeof(*jobs));
+        }
+        if (src)
+            src->exec_seqno = dst->exec_seqno;
+        if (pat)
+            pat->exec_seqno = dst->exec_seqno;
+        return 0;
+    }
+
+#ifdef RGA_HAVE_JOB_API
+    if (drv->batching && !jobs->dither) {
+        if (reserve_job(drv, 3, nr_jobs) == 0) {
+            add_job_buffer(drv, dst);
+            if (src)
+                add_job_buffer(drv, src);
+            if (pat)
+                add_job_buffer(drv, pat);
+
+            return add_job_tasks(drv, jobs, nr_jobs);
+        }
+    }
+
+    if ((src && in_pending_job(drv, src)) || in_pending_job(drv, dst))
+        end_job(drv);
+#endif
+
+    /* the bands wait for the same fence, so that they run in parallel */
+    int read_fence = merge_fences(src ? src->fence : -1,
+            pat ? pat->fence : -1);
+    int acquire_fence = merge_fences(dst->fence, read_fence);
+    int release_fence = -1;
+
+    if (read_fence >= 0)
+        close(read_fence);
+    int ret = 0;
+
+    for (i = 0; i < nr_jobs; i++) {
+        int fence = -1;
+
+        jobs[i].usage |= IM_ASYNC;
+        IM_STATUS status = run_rga_job(jobs + i, acquire_fence, &fence);
+        if (rga_failed(status)) {
+            count_failure(drv, "improcess()", status);
+            if (i == 0)
+                ret = -1;
+            else
+                run_jobs_sync(drv, jobs + i, nr_jobs - i, acquire_fence);
+            break;
+        }
+
+        if (fence >= 0) {
+            int merged = merge_fences(release_fence, fence);
+            if (release_fence >= 0)
+                close(release_fence);
+            close(fence);
+            release_fence = merged;
+        }
+    }
+
+    if (acquire_fence >= 0)
+        close(acquire_fence);
+
+    if (release_fence >= 0) {
+        int fence = merge_fences(drv->fence, release_fence);
+        if (drv->fence >= 0)
+            close(drv->fence);
+        drv->fence = fence;
+
+        if (src && src != dst)
+            set_fence(src, dup(release_fence));
+        if (pat && pat != dst && pat != src)
+            set_fence(pat, dup(release_fence));
+        set_fence(dst, release_fence);
+    }
+
+    return ret;
+}
+
+/*
+ * RGA3 does not fill, does no raster operations or color keys, and knows
+ * the formats without alpha first only. It wants 16-pixel aligned strides,
+ * rectangles not narrower than 68 pixels, and a scaling within 8 times.
+ */
+static bool rga3_format(int rk_format)
+{
+    switch (rk_format) {
+        case RK_FORMAT_RGBA_8888:
+        case RK_FORMAT_BGRA_8888:
+        case RK_FORMAT_RGBX_8888:
+        case RK_FORMAT_BGRX_8888:
+        case RK_FORMAT_RGB_888:
+        case RK_FORMAT_BGR_888:
+        case RK_FORMAT_RGB_565:
+        case RK_FORMAT_BGR_565:
+            return true;
+    }
+
+    return is_yuv_format(rk_format);
+}
+
+static bool rga3_can_do(const struct rga_job *job)
+{
+    const im_rect *src_rc = &job->src_rect, *dst_rc = &job->dst_rect;
+
+    if (job->dither || job->usage & (IM_COLOR_FILL | IM_ROP |
+                IM_ALPHA_COLORKEY_MASK | IM_COLOR_PALETTE | IM_MOSAIC | IM_OSD))
+        return false;
+
+    if (!rga3_format(job->src.format) || !rga3_format(job->dst.format) ||
+            job->src.wstride % 16 || job->dst.wstride % 16)
+        return false;
+
+    if (job->pat_rect.width &&
+            (!rga3_format(job->pat.format) || job->pat.wstride % 16))
+        return false;
+
+    if (src_rc->width < 68 || dst_rc->width < 68 ||
+            src_rc->height < 2 || dst_rc->height < 2)
+        return false;
+
+    return src_rc->width <= dst_rc->width * 8 &&
+        dst_rc->width <= src_rc->width * 8 &&
+        src_rc->height <= dst_rc->height * 8 &&
+        dst_rc->height <= src_rc->height * 8;
+}
+
+/* Whether an input of a job overlaps its output in the same buffer; the
+   buffers of an atlas page share its RGA handle. */
+static bool reads_output(const rga_buffer_t *in, const im_rect *in_rc,
+        const rga_buffer_t *out, const im_rect *out_rc)
+{
+    return in->handle && in->handle == out->handle &&
+        in_rc->x < out_rc->x + out_rc->width &&
+        out_rc->x < in_rc->x + in_rc->width &&
+        in_rc->y < out_rc->y + out_rc->height &&
+        out_rc->y < in_rc->y + in_rc->height;
+}
+
+/*
+ * Assign the cores to an operation. A large operation without scaling or
+ * transformation is split into horizontal bands, one for each core which
+ * can do it, and the bands run in parallel; a band has an even number of
+ * lines for the 4:2:0 formats, and a multiple of four for the dither
+ * matrix. A small one goes to the next core which can do it, round-robin.
+ * The executor runs the jobs one by one, so it does not get the bands;
+ * neither does an AFBC operation, which runs on RGA3, nor one which reads
+ * the rectangle it writes in the same buffer, like a scroll, as a band
+ * would read the lines another one writes. Returns the number of jobs.
+ */
+static int schedule_job(DrmDriver *drv, struct rga_job *jobs)
+{
+    int cores[RGA_MAX_CORES];
+    int nr_cores = 0, nr_bands, band_height, y, i;
+    bool rga3 = rga3_can_do(jobs);
+    bool fbc = false;
+
+#ifdef RK_HAVE_AFBC
+    fbc = jobs->src.rd_mode == IM_FBC_MODE ||
+        jobs->pat.rd_mode == IM_FBC_MODE || jobs->dst.rd_mode == IM_FBC_MODE;
+#endif
+
+    for (i = 0; i < drv->nr_cores; i++) {
+        if (drv->cores[i] & RGA3_CORES ? rga3 : !fbc)
+            cores[nr_cores++] = drv->cores[i];
+    }
+
+    if (nr_cores == 0)
+        return 1;
+
+    const im_rect dst_rc = jobs->dst_rect;
+    if (nr_cores == 1 || drv->executor || fbc ||
+            (int64_t)dst_rc.width * dst_rc.height < RGA_BAND_MIN_PIXELS ||
+            (jobs->usage & IM_HAL_TRANSFORM_MASK) ||
+            ((jobs->usage & IM_COLOR_FILL) == 0 &&
+             (jobs->src_rect.width != dst_rc.width ||
+              jobs->src_rect.height != dst_rc.height ||
+              reads_output(&jobs->src, &jobs->src_rect,
+                  &jobs->dst, &dst_rc))) ||
+            (jobs->pat_rect.width && jobs->pat_rect.y != dst_rc.y &&
+             reads_output(&jobs->pat, &jobs->pat_rect, &jobs->dst, &dst_rc))) {
+        /* the passes of a raster operation go to the same core */
+        if (jobs->usage & IM_ROP)
+            jobs->opt.core = cores[0];
+        else
+            jobs->opt.core = cores[drv->next_core++ % nr_cores];
+        return 1;
+    }
+
+    nr_bands = nr_cores;
+    band_height = ROUND_TO_MULTIPLE(dst_rc.height / nr_bands,
+            jobs->dither ? 4 : 2);
+    for (i = 0, y = 0; i < nr_bands; i++, y += band_height) {
+        if (i > 0)
+            jobs[i] = jobs[0];
+        if (i == nr_bands - 1)
+            band_height = dst_rc.height - y;
+
+        jobs[i].dst_rect.y = dst_rc.y + y;
+        jobs[i].dst_rect.height = band_height;
+        if ((jobs->usage & IM_COLOR_FILL) == 0) {
+            jobs[i].src_rect.y = jobs[0].src_rect.y + y;
+            jobs[i].src_rect.height = band_height;
+        }
+        if (jobs->pat_rect.width) {
+            jobs[i].pat_rect.y = jobs[0].pat_rect.y + y;
+            jobs[i].pat_rect.height = band_height;
+        }
+        jobs[i].opt.core = cores[i];
+    }
+
+    return nr_bands;
+}
+
+/* Fill a rectangle of a buffer. */
+static int rga_fill(DrmDriver *drv, my_surface_buffer *dst,
+        im_rect rect, uint32_t pixel)
+{
+    struct rga_job jobs[RGA_MAX_CORES];
+
+    memset(jobs, 0, sizeof(jobs[0]));
+    jobs[0].dst = dst->rga_buffer;
+    jobs[0].dst_rect = rect;
+    jobs[0].opt.color = pixel;
+    jobs[0].usage = IM_COLOR_FILL;
+    return rga_submit(drv, NULL, NULL, dst, jobs, schedule_job(drv, jobs));
+}
+
+/* The number of bits per pixel of the colors; 0 for the YUV formats. */
+static int color_depth(int rk_format)
+{
+    switch (rk_format) {
+        case RK_FORMAT_ARGB_4444:
+        case RK_FORMAT_ABGR_4444:
+        case RK_FORMAT_RGBA_4444:
+        case RK_FORMAT_BGRA_4444:
+            return 12;
+        case RK_FORMAT_RGBA_5551:
+        case RK_FORMAT_BGRA_5551:
+            return 15;
+        case RK_FORMAT_RGB_565:
+        case RK_FORMAT_BGR_565:
+            return 16;
+    }
+
+    return is_yuv_format(rk_format) ? 0 : 24;
+}
+
+/*
+ * RGA2 dithers a copy into a destination of lower depth, so that an ARGB8888
+ * content on an RGB565 scanout is not banded. A copy with the bilinear or
+ * a better interpolation is not dithered, as c_RkRgaBlit() does not take it.
+ */
+static bool use_dither(DrmDriver *drv, const my_surface_buffer *src,
+        const my_surface_buffer *dst, const im_opt_t *opt, int usage)
+{
+    int depth = color_depth(dst->rk_format);
+
+    if (!drv->dither || depth == 0 || depth >= color_depth(src->rk_format))
+        return false;
+
+    if (usage & ~(IM_HAL_TRANSFORM_MASK | IM_ALPHA_BLEND_SRC))
+        return false;
+
+#ifdef RGA_HAVE_INTERP
+    if (opt->interp)
+        return false;
+#else
+    (void)opt;
+#endif
+
+    return !src->afbc && !dst->afbc;
+}
+
+/* Process a blit; it was checked by imcheck() already. */
+static int rga_process(DrmDriver *drv,
+        my_surface_buffer *src, im_rect src_rect,
+        my_surface_buffer *dst, im_rect dst_rect,
+        const im_opt_t *opt, int usage)
+{
+    struct rga_job jobs[RGA_MAX_CORES];
+
+    memset(jobs, 0, sizeof(jobs[0]));
+    jobs[0].src = src->rga_buffer;
+    jobs[0].dst = dst->rga_buffer;
+    jobs[0].src_rect = src_rect;
+    jobs[0].dst_rect = dst_rect;
+    jobs[0].opt = *opt;
+    jobs[0].usage = usage;
+    jobs[0].dither = use_dither(drv, src, dst, opt, usage);
+
+    /* librga takes the color space conversion from the destination */
+    if (is_yuv_format(src->rk_format) && !is_yuv_format(dst->rk_format))
+        jobs[0].dst.color_space_mode = src->color_space;
+
+    return rga_submit(drv, src, NULL, dst, jobs, schedule_job(drv, jobs));
+}
+
+/* RGA2 converts from BT.709 with the limited range only. */
+static int set_color_space(DrmDriver *drv, DrmSurfaceBuffer *buffer,
+        int color_space)
+{
+    my_surface_buffer *mybuf = (my_surface_buffer *)buffer;
+    (void)drv;
+
+    if (!is_yuv_format(mybuf->rk_format))
+        return -1;
+
+    switch (color_space) {
+        case HBDDRM_COLOR_SPACE_BT601:
+            mybuf->color_space = IM_YUV_TO_RGB_BT601_LIMIT;
+            break;
+        case HBDDRM_COLOR_SPACE_BT601 | HBDDRM_COLOR_RANGE_FULL:
+            mybuf->color_space = IM_YUV_TO_RGB_BT601_FULL;
+            break;
+        case HBDDRM_COLOR_SPACE_BT709:
+            mybuf->color_space = IM_YUV_TO_RGB_BT709_LIMIT;
+            break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+static int get_modifier(DrmDriver *drv, DrmSurfaceBuffer *buffer,
+        uint64_t *modifier)
+{
+    (void)drv;
+
+#ifdef RK_HAVE_AFBC
+    if (((my_surface_buffer *)buffer)->afbc) {
+        *modifier = RK_AFBC_MODIFIER;
+        return 0;
+    }
+#else
+    (void)buffer;
+#endif
+
+    *modifier = DRM_FORMAT_MOD_LINEAR;
+    return 0;
+}
+
+static uint32_t geometry_class(const rga_buffer_t *buf, const im_rect *rc)
+{
+    uint32_t cls = 0;
+
+    if (buf->wstride % 16)
+        cls |= 0x01;
+    if (buf->wstride % 4)
+        cls |= 0x02;
+    if ((rc->x | rc->y | rc->width | rc->height) & 1)
+        cls |= 0x04;
+    if (rc->width < 2 || rc->height < 2)
+        cls |= 0x08;
+    if (rc->width > 4096 || rc->height > 4096)
+        cls |= 0x10;
+    if (rc->width > 8192 || rc->height > 8192)
+        cls |= 0x20;
+    return cls;
+}
+
+static uint32_t scaling_class(int from, int to)
+{
+    if (from == to)
+        return 0;
+    if (to > from)
+        return (to <= from * 8) ? 1 : (to <= from * 16) ? 2 : 3;
+    return (to * 8 >= from) ? 4 : (to * 16 >= from) ? 5 : 6;
+}
+
+/* Count an operation left to the CPU as refused by check_rga(), by the
+   negated status of the last check failed; returns -1 for the callers. */
+static int fall_back_check(DrmDriver *drv)
+{
+    int index = -(int)drv->check_status;
+
+    if (index < 0 || index >= HBDDRM_NR_CHECK_STATUS)
+        index = HBDDRM_NR_CHECK_STATUS - 1;
+    drv->stats.nr_rejects[index]++;
+    return fall_back(drv, HBDDRM_FALLBACK_CHECK);
+}
+
+/* Whether a rectangle is inside the RGA buffer; the cache of imcheck()
+   results does not know the bounds. */
+static inline bool rect_in_rga_buffer(const rga_buffer_t *buf,
+        const im_rect *rc)
+{
+    return rc->x >= 0 && rc->y >= 0 && rc->width > 0 && rc->height > 0 &&
+        rc->x + rc->width <= buf->width && rc->y + rc->height <= buf->height;
+}
+
+/*
+ * Check an operation with imcheck(). The rectangles are checked against
+ * the buffers first, then the result is looked up in the cache unless the
+ * validation is enabled, then imcheck() runs for every call. A refusal
+ * is counted by fall_back_check() only if the operation falls back; a
+ * blit refused as a whole may still be done as tiles.
+ */
+static bool check_rga(DrmDriver *drv,
+        const rga_buffer_t *src, const im_rect *src_rc,
+        const rga_buffer_t *pat, const im_rect *pat_rc,
+        const rga_buffer_t *dst, const im_rect *dst_rc, int usage)
+{
+    rga_buffer_t dummy_pat = {};
+    im_rect dummy_pat_rc = {};
+    struct rga_check_entry key, *entry = NULL;
+    IM_STATUS status;
+    unsigned i, hash;
+
+    if (!rect_in_rga_buffer(dst, dst_rc) || (pat &&
+                !rect_in_rga_buffer(pat, pat_rc)) || ((src->format ||
+                    src->wstride) && !rect_in_rga_buffer(src, src_rc))) {
+        _DBG_PRINTF("Rectangles out of the buffers (usage 0x%x)\n", usage);
+        drv->check_status = IM_STATUS_INVALID_PARAM;
+        return false;
+    }
+
+    if (!drv->validate) {
+        memset(&key, 0, sizeof(key));
+        key.src_format = src->format;
+        key.dst_format = dst->format;
+        key.pat_format = pat ? pat->format : -1;
+        key.usage = usage;
+        key.geometry = geometry_class(dst, dst_rc);
+        if (src->format || src->wstride) {
+            key.geometry |= geometry_class(src, src_rc) << 8;
+            key.geometry |= scaling_class(src_rc->width, dst_rc->width) << 16;
+            key.geometry |= scaling_class(src_rc->height, dst_rc->height) << 20;
+        }
+        if (pat)
+            key.geometry |= geometry_class(pat, pat_rc) << 24;
+
+        hash = (unsigned)(key.src_format * 31 + key.dst_format) * 31;
+        hash = (hash + (unsigned)key.pat_format) * 31;
+        hash = (hash + (unsigned)key.usage) * 31 + key.geometry;
+        for (i = 0; i < 4; i++) {
+            entry = drv->check_cache +
+                (hash + i) % RGA_CHECK_CACHE_SIZE;
+            if (!entry->used)
+                break;
+            if (entry->src_format == key.src_format &&
+                    entry->dst_format == key.dst_format &&
+                    entry->pat_format == key.pat_format &&
+                    entry->usage == key.usage &&
+                    entry->geometry == key.geometry) {
+                if (rga_failed(entry->status))
+                    drv->check_status = entry->status;
+                return !rga_failed(entry->status);
+            }
+        }
+
+        /* replace the first entry probed if all are used */
+        if (entry->used)
+            entry = drv->check_cache + hash % RGA_CHECK_CACHE_SIZE;
+    }
+
+#ifdef imcheck_composite
+    status = imcheck_composite(*src, *dst, pat ? *pat : dummy_pat,
+            *src_rc, *dst_rc, pat_rc ? *pat_rc : dummy_pat_rc, usage);
+#else
+    (void)dummy_pat;
+    (void)dummy_pat_rc;
+    if (pat)
+        status = IM_STATUS_NOT_SUPPORTED;
+    else
+        status = imcheck(*src, *dst, *src_rc, *dst_rc, usage);
+#endif
+    if (rga_failed(status)) {
+        _DBG_PRINTF("Failed imcheck(0x%x): %s\n", usage, imStrError(status));
+        drv->check_status = status;
+    }
+
+    if (entry) {
+        key.used = true;
+        key.status = status;
+        *entry = key;
+    }
+
+    return !rga_failed(status);
+}
+
+/* Check a fill; a fill refused is counted as left to the CPU. */
+static bool check_fill(DrmDriver *drv, my_surface_buffer *dst,
+        const im_rect *dst_imrc)
+{
+    rga_buffer_t dummy_src = {};
+    im_rect src_imrc = {};
+
+    if (is_yuv_format(dst->rk_format) || dst->afbc) {
+        fall_back(drv, HBDDRM_FALLBACK_FORMAT);
+        return false;
+    }
+
+    if (!import_rga_buffer(drv, dst)) {
+        fall_back(drv, HBDDRM_FALLBACK_IMPORT);
+        return false;
+    }
+
+    if (!check_rga(drv, &dummy_src, &src_imrc, NULL, NULL,
+                &dst->rga_buffer, dst_imrc, IM_COLOR_FILL)) {
+        fall_back_check(drv);
+        return false;
+    }
+
+    return true;
+}
+
+static int rockchip_fill_rect(DrmDriver *drv,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *rc, uint32_t pixel)
+{
+    my_surface_buffer *mybuf = (my_surface_buffer *)dst_buf;
+    im_rect dst_imrc = to_imrect(mybuf, rc);
+
+    if (!check_fill(drv, mybuf, &dst_imrc)) {
+        return -1;
+    }
+
+    return rga_fill(drv, mybuf, dst_imrc, pixel);
+}
+
+/* The rectangles given to librga in one call. */
+#define RGA_RECTS_PER_CALL      64
+
+/* Split the outline of a rectangle into the strips to fill; returns the
+   number of them, which is 1 if the outline covers the rectangle. */
+static int outline_strips(im_rect rc, int thickness, im_rect *strips)
+{
+    if (thickness == 0 ||
+            rc.width <= thickness * 2 || rc.height <= thickness * 2) {
+        strips[0] = rc;
+        return 1;
+    }
+
+    strips[0] = (im_rect){ rc.x, rc.y, rc.width, thickness };
+    strips[1] = (im_rect){ rc.x, rc.y + rc.height - thickness,
+        rc.width, thickness };
+    strips[2] = (im_rect){ rc.x, rc.y + thickness,
+        thickness, rc.height - thickness * 2 };
+    strips[3] = (im_rect){ rc.x + rc.width - thickness,
+        rc.y + thickness, thickness, rc.height - thickness * 2 };
+    return 4;
+}
+
+/*
+ * Fill the rectangles or draw their outlines (if thickness is not 0) as
+ * one RGA job: the pending job in the batching mode, or a job of its own.
+ * With the executor, without the job API, or for more fills than the tasks
+ * of a job, the rectangles are submitted one by one, and an outline is four
+ * fills. The rectangles, and the strips of the outlines, are checked before
+ * any is submitted; a job is cancelled if a task cannot be added to it.
+ */
+static int rga_fill_rects(DrmDriver *drv, my_surface_buffer *dst,
+        const GAL_Rect *rcs, int nr_rcs, uint32_t pixel, int thickness)
+{
+    im_rect imrcs[RGA_RECTS_PER_CALL];
+    int i, n, nr_tasks = 0;
+
+    /* RGA refuses the strips of an outline which are too thin */
+    for (i = 0; i < nr_rcs; i++) {
+        n = outline_strips(to_imrect(dst, rcs + i), thickness, imrcs);
+        nr_tasks += n;
+        while (n--) {
+            if (!check_fill(drv, dst, imrcs + n))
+                return -1;
+        }
+    }
+
+#ifdef RGA_HAVE_JOB_API
+    if (drv->executor == NULL && nr_tasks <= RGA_JOB_MAX_TASKS) {
+        if (reserve_job(drv, 1, nr_tasks) == 0) {
+            int nr_old_tasks = drv->nr_job_tasks;
+
+            add_job_buffer(drv, dst);
+
+            for (i = 0; i < nr_rcs; i += n) {
+                IM_STATUS status;
+                int j;
+
+                for (n = 0; n < RGA_RECTS_PER_CALL && i + n < nr_rcs; n++)
+                    imrcs[n] = to_imrect(dst, rcs + i + n);
+
+                if (thickness)
+                    status = imrectangleTaskArray(drv->job, dst->rga_buffer,
+                            imrcs, n, pixel, thickness);
+                else
+                    status = imfillTaskArray(drv->job, dst->rga_buffer,
+                            imrcs, n, pixel);
+                if (rga_failed(status)) {
+                    count_failure(drv, thickness ? "imrectangleTaskArray()" :
+                            "imfillTaskArray()", status);
+                    cancel_job(drv, nr_old_tasks);
+                    return -1;
+                }
+
+                drv->stats.nr_jobs++;
+                drv->stats.nr_ops[HBDDRM_OP_FILL] += n;
+                for (j = 0; j < n; j++) {
+                    im_rect strips[4];
+                    int k, nr_strips = outline_strips(imrcs[j], thickness,
+                            strips);
+
+                    for (k = 0; k < nr_strips; k++) {
+                        drv->stats.nr_bytes += rect_bytes(dst, strips + k);
+                        log_fill_task(drv, dst, strips[k], pixel);
+                    }
+                }
+            }
+
+            if (!drv->batching)
+                end_job(drv);
+            return 0;
+        }
+    }
+#endif
+
+    for (i = 0; i < nr_rcs; i++) {
+        n = outline_strips(to_imrect(dst, rcs + i), thickness, imrcs);
+        while (n--) {
+            if (rga_fill(drv, dst, imrcs[n], pixel))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int fill_rects(DrmDriver *drv, DrmSurfaceBuffer *dst_buf,
+        const GAL_Rect *rcs, int nr_rcs, uint32_t pixel)
+{
+    return rga_fill_rects(drv, (my_surface_buffer *)dst_buf,
+            rcs, nr_rcs, pixel, 0);
+}
+
+static int draw_rects(DrmDriver *drv, DrmSurfaceBuffer *dst_buf,
+        const GAL_Rect *rcs, int nr_rcs, uint32_t pixel, int thickness)
+{
+    return rga_fill_rects(drv, (my_surface_buffer *)dst_buf,
+            rcs, nr_rcs, pixel, thickness);
+}
+
+/*
+ * A raster operation of MiniGUI, COLOR_LOGICOP_* >> COLOR_LOGICOP_SHIFT, is
+ * the truth table of the source and the destination pixels, indexed by
+ * src * 2 + dst. A ROP3 code of RGA is the truth table indexed by
+ * pat * 4 + src * 2 + dst, so the code is the table of MiniGUI repeated
+ * for both values of the pattern. RGA2 does every ROP3 code; with the
+ * others, we use the codes named by librga, and do the rest in two passes
+ * of them. CLEAR, SET, and NOOP are not done as raster operations.
+ */
+static const struct rop_passes {
+    int first;
+    int second;
+} rop_passes[16] = {
+    [COLOR_LOGICOP_NOR >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_OR, IM_ROP_NOT_DST },
+    [COLOR_LOGICOP_AND_INVERTED >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_OR, IM_ROP_XOR },
+    [COLOR_LOGICOP_COPY_INVERTED >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_NOT_SRC, 0 },
+    [COLOR_LOGICOP_AND_REVERSE >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_NOT_DST, IM_ROP_AND },
+    [COLOR_LOGICOP_INVERT >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_NOT_DST, 0 },
+    [COLOR_LOGICOP_XOR >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_XOR, 0 },
+    [COLOR_LOGICOP_NAND >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_AND, IM_ROP_NOT_DST },
+    [COLOR_LOGICOP_AND >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_AND, 0 },
+    [COLOR_LOGICOP_EQUIV >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_NOT_XOR, 0 },
+    [COLOR_LOGICOP_OR_INVERTED1 >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_AND, IM_ROP_NOT_XOR },
+    [COLOR_LOGICOP_OR_REVERSE >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_NOT_DST, IM_ROP_OR },
+    [COLOR_LOGICOP_OR >> COLOR_LOGICOP_SHIFT] =
+        { IM_ROP_OR, 0 },
+};
+
+static int get_blend_usage(ColorBlendMethod bld)
+{
+    switch (bld) {
+        case COLOR_BLEND_PD_SRC:
+            return IM_ALPHA_BLEND_SRC;
+        case COLOR_BLEND_PD_DST:
+            return IM_ALPHA_BLEND_DST;
+        case COLOR_BLEND_PD_SRC_OVER:
+            return IM_ALPHA_BLEND_SRC_OVER;
+        case COLOR_BLEND_PD_DST_OVER:
+            return IM_ALPHA_BLEND_DST_OVER;
+        case COLOR_BLEND_PD_SRC_IN:
+            return IM_ALPHA_BLEND_SRC_IN;
+        case COLOR_BLEND_PD_DST_IN:
+            return IM_ALPHA_BLEND_DST_IN;
+        case COLOR_BLEND_PD_SRC_OUT:
+            return IM_ALPHA_BLEND_SRC_OUT;
+        case COLOR_BLEND_PD_DST_OUT:
+            return IM_ALPHA_BLEND_DST_OUT;
+        case COLOR_BLEND_PD_SRC_ATOP:
+            return IM_ALPHA_BLEND_SRC_ATOP;
+        case COLOR_BLEND_PD_DST_ATOP:
+            return IM_ALPHA_BLEND_DST_ATOP;
+        case COLOR_BLEND_PD_XOR:
+            return IM_ALPHA_BLEND_XOR;
+        default:
+            break;
+    }
+
+    return -1;
+}
+
+/* Get the usage and the options of a blit; the second ROP code is not 0
+   if the raster operation takes a second pass. */
+static int get_usage_opt(DrmDriver *drv, const DrmBlitOperations *ops,
+        im_opt_t *opt, int *second_rop)
+{
+    int usage = 0;
+
+    switch (ops->cpy) {
+        case BLIT_COPY_TRANSLATE:
+            break;
+        case BLIT_COPY_ROT_90:
+            usage |= IM_HAL_TRANSFORM_ROT_90;
+            break;
+        case BLIT_COPY_ROT_180:
+            usage |= IM_HAL_TRANSFORM_ROT_180;
+            break;
+        case BLIT_COPY_ROT_270:
+            usage |= IM_HAL_TRANSFORM_ROT_270;
+            break;
+        case BLIT_COPY_FLIP_H:
+            usage |= IM_HAL_TRANSFORM_FLIP_H;
+            break;
+        case BLIT_COPY_FLIP_V:
+            usage |= IM_HAL_TRANSFORM_FLIP_V;
+            break;
+        case BLIT_COPY_FLIP_H_V:
+            usage |= IM_HAL_TRANSFORM_FLIP_H_V;
+            break;
+    }
+
+    switch (ops->key) {
+        case BLIT_COLORKEY_NONE:
+            break;
+        case BLIT_COLORKEY_NORMAL:
+            usage |= IM_ALPHA_COLORKEY_NORMAL;
+            if (opt) {
+                opt->colorkey_range.min = ops->key_min;
+                opt->colorkey_range.max = ops->key_max;
+            }
+            break;
+        case BLIT_COLORKEY_INVERTED:
+            usage |= IM_ALPHA_COLORKEY_INVERTED;
+            if (opt) {
+                opt->colorkey_range.min = ops->key_min;
+                opt->colorkey_range.max = ops->key_max;
+            }
+            break;
+    }
+
+    switch (ops->alf) {
+        case BLIT_ALPHA_NONE:
+        case BLIT_ALPHA_SET:
+            break;
+    }
+
+    int blend = get_blend_usage(ops->bld);
+    if (blend == -1)
+        return -1;
+    usage |= blend;
+
+    *second_rop = 0;
+    if (ops->rop != COLOR_LOGICOP_COPY) {
+        unsigned c = (ops->rop >> COLOR_LOGICOP_SHIFT) & 0x0F;
+        int rop_code = c | c << 4;
+
+        if (!drv->has_rop3) {
+            rop_code = rop_passes[c].first;
+            *second_rop = rop_passes[c].second;
+        }
+
+        if (rop_code == 0)
+            return -1;
+
+        usage |= IM_ROP;
+        if (opt) {
+            opt->rop_code = rop_code;
+        }
+    }
+
+    return usage;
+}
+
+/*
+ * Choose the interpolation for a scaling filter of MiniGUI: the fast and
+ * the nearest filters leave it to the hardware, the good and the bilinear
+ * ones want the bilinear, and the best and the convolution ones want the
+ * bicubic for upscaling or the averaging for downscaling. A mode the RGA
+ * does not have is downgraded to the bilinear, which every RGA has.
+ */
+static void set_interp(DrmDriver *drv, ScalingFilter scl,
+        const im_rect *src_rc, const im_rect *dst_rc, im_opt_t *opt)
+{
+#ifdef RGA_HAVE_INTERP
+    bool up = dst_rc->width * dst_rc->height > src_rc->width * src_rc->height;
+    unsigned caps = up ? drv->interp_caps->up : drv->interp_caps->down;
+    int mode;
+
+    if (src_rc->width == dst_rc->width && src_rc->height == dst_rc->height)
+        return;
+
+    switch (scl) {
+        case SCALING_FILTER_GOOD:
+        case SCALING_FILTER_BILINEAR:
+            mode = IM_INTERP_LINEAR;
+            break;
+
+        case SCALING_FILTER_BEST:
+        case SCALING_FILTER_CONVOLUTION:
+            mode = up ? IM_INTERP_CUBIC : IM_INTERP_AVERAGE;
+            break;
+
+        default:
+            return;
+    }
+
+    if (!(caps & RGA_INTERP_BIT(mode)))
+        mode = IM_INTERP_LINEAR;
+
+    opt->interp = RGA_INTERP(mode);
+#else
+    (void)drv;
+    (void)scl;
+    (void)src_rc;
+    (void)dst_rc;
+    (void)opt;
+#endif
+}
+
+
+/* The size of the tiles of an operation beyond the limits of RGA, which
+   every version takes, and the alignment of their left and right edges. */
+#define RGA_TILE_MAX_SIZE   4096
+#define RGA_TILE_ALIGN      16
+
+/* The maximal number of columns of a tiled operation, the strips included. */
+#define RGA_MAX_TILE_COLS   8
+
+/* The address of the RGA buffer of a surface for the CPU; the buffer of
+   the page for a surface in an atlas page. */
+static uint8_t *get_cpu_pixels(DrmDriver *drv, my_surface_buffer *buf)
+{
+    if (buf->vaddr)
+        return buf->vaddr;
+
+    return get_mapping(drv, buf);
+}
+
+/* Copy a rectangle of the same format by the CPU; the rectangles are in
+   the RGA buffers, and the jobs on both buffers were waited for. */
+static int cpu_copy(DrmDriver *drv,
+        my_surface_buffer *src, const im_rect *src_rc,
+        my_surface_buffer *dst, const im_rect *dst_rc)
+{
+    const uint8_t *src_pixels = get_cpu_pixels(drv, src);
+    uint8_t *dst_pixels = get_cpu_pixels(drv, dst);
+    size_t src_pitch = src->rga_buffer.wstride * src->base.cpp;
+    size_t dst_pitch = dst->rga_buffer.wstride * dst->base.cpp;
+    size_t row_size = dst_rc->width * dst->base.cpp;
+    int y;
+
+    if (src_pixels == NULL || dst_pixels == NULL)
+        return -1;
+
+    src_pixels += src_rc->y * src_pitch + src_rc->x * src->base.cpp;
+    dst_pixels += dst_rc->y * dst_pitch + dst_rc->x * dst->base.cpp;
+    for (y = 0; y < dst_rc->height; y++) {
+        memcpy(dst_pixels, src_pixels, row_size);
+        src_pixels += src_pitch;
+        dst_pixels += dst_pitch;
+    }
+
+    return 0;
+}
+
+/*
+ * Split an unscaled operation which imcheck() refuses as a whole, because
+ * it is too large or misaligned. The interior, aligned to RGA_TILE_ALIGN
+ * pixels horizontally, goes to RGA in tiles of RGA_TILE_MAX_SIZE pixels at
+ * most. The strips left at the left and right edges go to RGA as well if it
+ * takes them, so they may run on another core; or, for a plain copy, the
+ * CPU copies them before the tiles are submitted. All the pieces are checked
+ * before any is done, and only checked unless run is true. Once a piece is
+ * done, the operation does not fail, as the CPU would apply it twice to the
+ * pieces done; but a plain copy does, as the CPU may copy them again.
+ */
+static bool tile_blit(DrmDriver *drv,
+        my_surface_buffer *src, const im_rect *src_rc,
+        my_surface_buffer *dst, const im_rect *dst_rc,
+        const im_opt_t *opt, int usage, bool run)
+{
+    int cols[RGA_MAX_TILE_COLS + 1];
+    int nr_cols = 0, x0, x1, x, y, i, pass;
+    int dx = src_rc->x - dst_rc->x, dy = src_rc->y - dst_rc->y;
+    bool plain_copy = (usage & ~IM_ALPHA_BLEND_SRC) == 0 &&
+        src->rk_format == dst->rk_format;
+    bool cpu_access = false, done = false;
+    int ret = 0;
+
+    if (src_rc->width != dst_rc->width || src_rc->height != dst_rc->height ||
+            (usage & IM_HAL_TRANSFORM_MASK) || is_yuv_format(src->rk_format) ||
+            src->afbc || dst->afbc || src->rga_handle == dst->rga_handle)
+        return false;
+
+    x0 = ROUND_TO_MULTIPLE(dst_rc->x, RGA_TILE_ALIGN);
+    x1 = (dst_rc->x + dst_rc->width) & ~(RGA_TILE_ALIGN - 1);
+    if (x1 - x0 < RGA_TILE_ALIGN ||
+            (x1 - x0 + RGA_TILE_MAX_SIZE - 1) / RGA_TILE_MAX_SIZE + 2 >
+            RGA_MAX_TILE_COLS)
+        return false;
+
+    /* the edges of the columns: the left strip, the tiles, the right strip */
+    if (x0 > dst_rc->x)
+        cols[nr_cols++] = dst_rc->x;
+    for (x = x0; x < x1; x += RGA_TILE_MAX_SIZE)
+        cols[nr_cols++] = x;
+    if (x1 < dst_rc->x + dst_rc->width)
+        cols[nr_cols++] = x1;
+    cols[nr_cols] = dst_rc->x + dst_rc->width;
+
+    /* the check, then the CPU copies, as they wait for the jobs on the
+       buffers, then the RGA jobs */
+    for (pass = 0; pass < (run ? 3 : 1) && ret == 0; pass++) {
+        for (i = 0; i < nr_cols && ret == 0; i++) {
+            bool strip = cols[i] < x0 || cols[i] >= x1;
+
+            for (y = 0; y < dst_rc->height && ret == 0;
+                    y += RGA_TILE_MAX_SIZE) {
+                im_rect dst_tile = { cols[i], dst_rc->y + y,
+                    cols[i + 1] - cols[i],
+                    MIN(RGA_TILE_MAX_SIZE, dst_rc->height - y) };
+                im_rect src_tile = { dst_tile.x + dx, dst_tile.y + dy,
+                    dst_tile.width, dst_tile.height };
+                bool by_rga = check_rga(drv, &src->rga_buffer, &src_tile,
+                        NULL, NULL, &dst->rga_buffer, &dst_tile, usage);
+
+                if (pass == 0) {
+                    if (!by_rga && !(strip && plain_copy))
+                        ret = -1;
+                    continue;
+                }
+
+                if (by_rga != (pass == 2))
+                    continue;
+
+                /* a failure is counted by rga_submit() */
+                if (by_rga) {
+                    if (rga_process(drv, src, src_tile, dst, dst_tile,
+                                opt, usage) == 0)
+                        done = true;
+                    else if (!done || plain_copy)
+                        ret = -1;
+                    continue;
+                }
+
+                if (!cpu_access) {
+                    sync_buffer(drv, src);
+                    sync_buffer(drv, dst);
+                    sync_cpu_access(drv, src, DMA_BUF_SYNC_START);
+                    sync_cpu_access(drv, dst, DMA_BUF_SYNC_START);
+                    cpu_access = true;
+                }
+                ret = cpu_copy(drv, src, &src_tile, dst, &dst_tile);
+            }
+        }
+
+        if (cpu_access) {
+            sync_cpu_access(drv, src, DMA_BUF_SYNC_END);
+            sync_cpu_access(drv, dst, DMA_BUF_SYNC_END);
+            cpu_access = false;
+        }
+    }
+
+    return ret == 0;
+}
+
+static int blit(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+        const DrmBlitOperations *ops, bool tiled)
+{
+    my_surface_buffer *src = (my_surface_buffer *)src_buf;
+    my_surface_buffer *dst = (my_surface_buffer *)dst_buf;
+
+    im_rect src_imrc = to_imrect(src, src_rc);
+    im_rect dst_imrc = to_imrect(dst, dst_rc);
+
+    im_opt_t opt = { };
+    int second_rop;
+    int usage = get_usage_opt(drv, ops, &opt, &second_rop);
+    if (usage == -1)
+        return -1;
+    set_interp(drv, ops->scl, &src_imrc, &dst_imrc, &opt);
+
+    /* checked by rockchip_check_blit() already; the second pass of a raster
+       operation has the same usage, so this checks both passes */
+    if (!tiled && drv->validate && !check_rga(drv, &src->rga_buffer,
+                &src_imrc, NULL, NULL, &dst->rga_buffer, &dst_imrc, usage)) {
+        return -1;
+    }
+
+    if (ops->alf == BLIT_ALPHA_SET) {
+        src->rga_buffer.global_alpha = ops->alpha;
+    }
+    else {
+        src->rga_buffer.global_alpha = -1;
+    }
+
+    if (tiled) {
+        if (!tile_blit(drv, src, &src_imrc, dst, &dst_imrc, &opt, usage, true))
+            return -1;
+    }
+    else if (rga_process(drv, src, src_imrc, dst, dst_imrc, &opt, usage)) {
+        return -1;
+    }
+
+    /* the first pass changed dst, so the CPU cannot do the operation any
+       more; a failure of the second pass is counted only */
+    if (second_rop) {
+        opt.rop_code = second_rop;
+        if (tiled)
+            tile_blit(drv, src, &src_imrc, dst, &dst_imrc, &opt, usage, true);
+        else
+            rga_process(drv, src, src_imrc, dst, dst_imrc, &opt, usage);
+    }
+
+    return 0;
+}
+
+static int rockchip_blitter(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+        const DrmBlitOperations *ops)
+{
+    return blit(drv, src_buf, src_rc, dst_buf, dst_rc, ops, false);
+}
+
+static int rockchip_tiled_blitter(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+        const DrmBlitOperations *ops)
+{
+    return blit(drv, src_buf, src_rc, dst_buf, dst_rc, ops, true);
+}
+
+static int rockchip_noop_blit(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+        const DrmBlitOperations *ops)
+{
+    (void)drv;
+    (void)src_buf;
+    (void)src_rc;
+    (void)dst_buf;
+    (void)dst_rc;
+    (void)ops;
+    return 0;
+}
+
+/* COLOR_LOGICOP_CLEAR and COLOR_LOGICOP_SET ignore the source pixels. */
+static int rockchip_fill_blit(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+        const DrmBlitOperations *ops)
+{
+    my_surface_buffer *dst = (my_surface_buffer *)dst_buf;
+    (void)src_buf;
+    (void)src_rc;
+
+    return rga_fill(drv, dst, to_imrect(dst, dst_rc),
+            ops->rop == COLOR_LOGICOP_SET ? 0xFFFFFFFF : 0);
+}
+
+/*
+ * An operation on an AFBC surface runs on RGA3, and writes the whole
+ * superblocks of an AFBC destination: the rectangle is aligned to them,
+ * except at the right and bottom edges of the surface.
+ */
+static bool check_afbc(const my_surface_buffer *src, const im_rect *src_rc,
+        const my_surface_buffer *dst, const im_rect *dst_rc, int usage)
+{
+    struct rga_job job;
+
+    memset(&job, 0, sizeof(job));
+    job.src = src->rga_buffer;
+    job.dst = dst->rga_buffer;
+    job.src_rect = *src_rc;
+    job.dst_rect = *dst_rc;
+    job.usage = usage;
+    if (!rga3_can_do(&job))
+        return false;
+
+    if (dst->afbc) {
+        if (dst_rc->x % RK_AFBC_BLOCK_SIZE || dst_rc->y % RK_AFBC_BLOCK_SIZE)
+            return false;
+        if (dst_rc->width % RK_AFBC_BLOCK_SIZE &&
+                dst_rc->x + dst_rc->width != (int)dst->base.width)
+            return false;
+        if (dst_rc->height % RK_AFBC_BLOCK_SIZE &&
+                dst_rc->y + dst_rc->height != (int)dst->base.height)
+            return false;
+    }
+
+    return true;
+}
+
+static CB_DRM_BLIT rockchip_check_blit(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+        const DrmBlitOperations *ops)
 {
-    assert(buffer->buff == NULL);
+    my_surface_buffer *src = (my_surface_buffer *)src_buf;
+    my_surface_buffer *dst = (my_surface_buffer *)dst_buf;
 
-    if (buffer->prime_fd) {
-        buffer->buff = mmap(0, buffer->size,
-                PROT_READ | PROT_WRITE, MAP_SHARED, buffer->prime_fd, 0);
-    }
-    else {
-        struct drm_rockchip_gem_map_off req = {
-            .handle = buffer->handle,
-        };
+    im_rect src_imrc = to_imrect(src, src_rc);
+    im_rect dst_imrc = to_imrect(dst, dst_rc);
 
-        if (drmIoctl(drv->devfd, DRM_IOCTL_ROCKCHIP_GEM_MAP_OFFSET, &req)) {
-            _ERR_PRINTF("failed to ioctl gem map offset: %m.\n");
+    /* A YUV source is converted and scaled only; the color keys and
+       the raster operations work on RGB pixels. We do not convert RGB to
+       YUV either. */
+    if (is_yuv_format(src->rk_format)) {
+        if (ops->key != BLIT_COLORKEY_NONE ||
+                ops->rop != COLOR_LOGICOP_COPY) {
+            fall_back(drv, HBDDRM_FALLBACK_OPERATION);
             return NULL;
         }
+    }
+    else if (is_yuv_format(dst->rk_format)) {
+        fall_back(drv, HBDDRM_FALLBACK_FORMAT);
+        return NULL;
+    }
 
-        buffer->buff = mmap64(0, buffer->size, PROT_READ | PROT_WRITE,
-               MAP_SHARED, drv->devfd, req.offset);
+    /* the raster operations which do not read the pixels; a color key
+       or a blending would make them read the source */
+    if (ops->rop == COLOR_LOGICOP_NOOP0) {
+        return rockchip_noop_blit;
+    }
+    else if ((ops->rop == COLOR_LOGICOP_CLEAR ||
+                ops->rop == COLOR_LOGICOP_SET) &&
+            ops->key == BLIT_COLORKEY_NONE && ops->alf == BLIT_ALPHA_NONE &&
+            ops->bld == COLOR_BLEND_PD_SRC) {
+        return check_fill(drv, dst, &dst_imrc) ? rockchip_fill_blit : NULL;
     }
 
-    if (buffer->buff == MAP_FAILED) {
-        buffer->buff = NULL;
-        _ERR_PRINTF("failed to mmap buffer: %m.\n");
+    if (!import_rga_buffer(drv, src) || !import_rga_buffer(drv, dst)) {
+        fall_back(drv, HBDDRM_FALLBACK_IMPORT);
         return NULL;
     }
 
-    return buffer->buff;
-}
+    im_opt_t opt = { };
+    int second_rop;
+    int usage = get_usage_opt(drv, ops, &opt, &second_rop);
+    if (usage == -1) {
+        fall_back(drv, HBDDRM_FALLBACK_OPERATION);
+        return NULL;
+    }
 
-static void rockchip_unmap_buffer(DrmDriver *drv,
-        DrmSurfaceBuffer *buffer)
-{
-    (void)drv;
-    assert(buffer->buff);
+    if ((src->afbc || dst->afbc) &&
+            !check_afbc(src, &src_imrc, dst, &dst_imrc, usage)) {
+        fall_back(drv, HBDDRM_FALLBACK_FORMAT);
+        return NULL;
+    }
 
-    if (munmap(buffer->buff, buffer->size)) {
-        _WRN_PRINTF("Failed munmap: %m\n");
+    if (!check_rga(drv, &src->rga_buffer, &src_imrc,
+                NULL, NULL, &dst->rga_buffer, &dst_imrc, usage)) {
+        if (tile_blit(drv, src, &src_imrc, dst, &dst_imrc, &opt, usage,
+                    false))
+            return rockchip_tiled_blitter;
+
+        fall_back_check(drv);
+        return NULL;
     }
 
-    buffer->buff = NULL;
+    return rockchip_blitter;
 }
 
-static int rockchip_fill_rect(DrmDriver *drv,
-        DrmSurfaceBuffer *dst_buf, const GAL_Rect *rc, uint32_t pixel)
+/*
+ * Compose src over the background in one pass: the background is the
+ * pattern of RGA, and dst = blend(src, pat), so both inputs are read once
+ * and there is no copy of the background to dst first.
+ */
+static int composite(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+        DrmSurfaceBuffer *bg_buf, const GAL_Rect *bg_rc,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+        int blend, int alpha)
 {
-    (void)drv;
-    my_surface_buffer *mybuf = (my_surface_buffer *)dst_buf;
+    my_surface_buffer *src = (my_surface_buffer *)src_buf;
+    my_surface_buffer *bg = (my_surface_buffer *)bg_buf;
+    my_surface_buffer *dst = (my_surface_buffer *)dst_buf;
+    struct rga_job jobs[RGA_MAX_CORES];
 
-    if (mybuf->rga_handle == 0) {
-        return -1;
+    if (src_rc->w != dst_rc->w || src_rc->h != dst_rc->h ||
+            bg_rc->w != dst_rc->w || bg_rc->h != dst_rc->h) {
+        return fall_back(drv, HBDDRM_FALLBACK_OPERATION);
     }
 
-    im_rect dst_imrc = { rc->x, rc->y + mybuf->nr_hdr_lines, rc->w, rc->h };
-    rga_buffer_t dummy_src = {};
-    im_rect src_imrc = {};
+    if (is_yuv_format(dst->rk_format)) {
+        return fall_back(drv, HBDDRM_FALLBACK_FORMAT);
+    }
 
-    IM_STATUS status;
-    status = imcheck(dummy_src, mybuf->rga_buffer,
-            src_imrc, dst_imrc, IM_COLOR_FILL);
-    if (status) {
-        return -1;
+    if (!import_rga_buffer(drv, src) || !import_rga_buffer(drv, bg) ||
+            !import_rga_buffer(drv, dst)) {
+        return fall_back(drv, HBDDRM_FALLBACK_IMPORT);
     }
 
-    status= imfill(mybuf->rga_buffer, dst_imrc, pixel);
-    if (status) {
-        _WRN_PRINTF("Failed imfill(): %s\n",  imStrError(status));
-        return -1;
+    int usage = get_blend_usage((ColorBlendMethod)blend);
+    if (usage == -1)
+        return fall_back(drv, HBDDRM_FALLBACK_OPERATION);
+
+    memset(jobs, 0, sizeof(jobs[0]));
+    jobs[0].src = src->rga_buffer;
+    jobs[0].pat = bg->rga_buffer;
+    jobs[0].dst = dst->rga_buffer;
+    jobs[0].src_rect = to_imrect(src, src_rc);
+    jobs[0].pat_rect = to_imrect(bg, bg_rc);
+    jobs[0].dst_rect = to_imrect(dst, dst_rc);
+    jobs[0].usage = usage;
+    jobs[0].src.global_alpha = (alpha >= 0 && alpha < 255) ? alpha : -1;
+
+    /* the background is the second input of RGA3 */
+    if ((src->afbc || bg->afbc || dst->afbc) &&
+            (!check_afbc(src, &jobs[0].src_rect, dst, &jobs[0].dst_rect,
+                         usage) ||
+             !check_afbc(bg, &jobs[0].pat_rect, dst, &jobs[0].dst_rect,
+                         usage) || !rga3_can_do(jobs))) {
+        return fall_back(drv, HBDDRM_FALLBACK_FORMAT);
     }
 
-    return 0;
+    if (!check_rga(drv, &jobs[0].src, &jobs[0].src_rect,
+                &jobs[0].pat, &jobs[0].pat_rect,
+                &jobs[0].dst, &jobs[0].dst_rect, usage)) {
+        return fall_back_check(drv);
+    }
+
+    if (is_yuv_format(src->rk_format))
+        jobs[0].dst.color_space_mode = src->color_space;
+
+    return rga_submit(drv, src, bg, dst, jobs, schedule_job(drv, jobs));
 }
 
-static int get_usage_opt(const DrmBlitOperations *ops, im_opt_t *opt)
+static int rockchip_copy_buff(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
+        BlitCopyOperation op)
 {
+    my_surface_buffer *src = (my_surface_buffer *)src_buf;
+    my_surface_buffer *dst = (my_surface_buffer *)dst_buf;
+
+    if (is_yuv_format(dst->rk_format) && src->rk_format != dst->rk_format) {
+        return fall_back(drv, HBDDRM_FALLBACK_FORMAT);
+    }
+
+    if (!import_rga_buffer(drv, src) || !import_rga_buffer(drv, dst)) {
+        return fall_back(drv, HBDDRM_FALLBACK_IMPORT);
+    }
+
     int usage = 0;
+    im_rect src_imrc = to_imrect(src, src_rc);
+    im_rect dst_imrc = to_imrect(dst, dst_rc);
 
-    switch (ops->cpy) {
+    switch (op) {
         case BLIT_COPY_TRANSLATE:
             break;
+
         case BLIT_COPY_ROT_90:
             usage |= IM_HAL_TRANSFORM_ROT_90;
             break;
+
         case BLIT_COPY_ROT_180:
             usage |= IM_HAL_TRANSFORM_ROT_180;
             break;
+
         case BLIT_COPY_ROT_270:
             usage |= IM_HAL_TRANSFORM_ROT_270;
             break;
+
         case BLIT_COPY_FLIP_H:
             usage |= IM_HAL_TRANSFORM_FLIP_H;
             break;
+
         case BLIT_COPY_FLIP_V:
             usage |= IM_HAL_TRANSFORM_FLIP_V;
             break;
+
         case BLIT_COPY_FLIP_H_V:
             usage |= IM_HAL_TRANSFORM_FLIP_H_V;
             break;
     }
 
-    switch (ops->key) {
-        case BLIT_COLORKEY_NONE:
-            break;
-        case BLIT_COLORKEY_NORMAL:
-            usage |= IM_ALPHA_COLORKEY_NORMAL;
-            if (opt) {
-                opt->colorkey_range.min = ops->key_min;
-                opt->colorkey_range.max = ops->key_max;
-            }
-            break;
-        case BLIT_COLORKEY_INVERTED:
-            usage |= IM_ALPHA_COLORKEY_INVERTED;
-            if (opt) {
-                opt->colorkey_range.min = ops->key_min;
-                opt->colorkey_range.max = ops->key_max;
-            }
-            break;
+    if ((src->afbc || dst->afbc) &&
+            !check_afbc(src, &src_imrc, dst, &dst_imrc, usage)) {
+        return fall_back(drv, HBDDRM_FALLBACK_FORMAT);
     }
 
-    switch (ops->alf) {
-        case BLIT_ALPHA_NONE:
-        case BLIT_ALPHA_SET:
-            break;
+    if (!check_rga(drv, &src->rga_buffer, &src_imrc,
+                NULL, NULL, &dst->rga_buffer, &dst_imrc, usage)) {
+        return fall_back_check(drv);
     }
 
-    switch (ops->bld) {
-        case COLOR_BLEND_PD_SRC:
-            usage |= IM_ALPHA_BLEND_SRC;
-            break;
-        case COLOR_BLEND_PD_DST:
-            usage |= IM_ALPHA_BLEND_DST;
-            break;
-        case COLOR_BLEND_PD_SRC_OVER:
-            usage |= IM_ALPHA_BLEND_SRC_OVER;
-            break;
-        case COLOR_BLEND_PD_DST_OVER:
-            usage |= IM_ALPHA_BLEND_DST_OVER;
-            break;
-        case COLOR_BLEND_PD_SRC_IN:
-            usage |= IM_ALPHA_BLEND_SRC_IN;
-            break;
-        case COLOR_BLEND_PD_DST_IN:
-            usage |= IM_ALPHA_BLEND_DST_IN;
-            break;
-        case COLOR_BLEND_PD_SRC_OUT:
-            usage |= IM_ALPHA_BLEND_SRC_OUT;
-            break;
-        case COLOR_BLEND_PD_DST_OUT:
-            usage |= IM_ALPHA_BLEND_DST_OUT;
-            break;
-        case COLOR_BLEND_PD_SRC_ATOP:
-            usage |= IM_ALPHA_BLEND_SRC_ATOP;
-            break;
-        case COLOR_BLEND_PD_DST_ATOP:
-            usage |= IM_ALPHA_BLEND_DST_ATOP;
+    im_opt_t dummy_opt = {};
+    return rga_process(drv, src, src_imrc, dst, dst_imrc, &dummy_opt, usage);
+}
+
+/* The rectangles of a rotated present after merging; the more are merged
+   into the two which waste the fewest pixels when merged. */
+#define RGA_PRESENT_MAX_RECTS   16
+
+static inline int64_t rect_area(const GAL_Rect *rc)
+{
+    return (int64_t)rc->w * rc->h;
+}
+
+static GAL_Rect rect_union(const GAL_Rect *a, const GAL_Rect *b)
+{
+    GAL_Rect u;
+
+    u.x = MIN(a->x, b->x);
+    u.y = MIN(a->y, b->y);
+    u.w = MAX(a->x + a->w, b->x + b->w) - u.x;
+    u.h = MAX(a->y + a->h, b->y + b->h) - u.y;
+    return u;
+}
+
+/*
+ * Add a dirty rectangle to the list, which has room for one more than
+ * RGA_PRESENT_MAX_RECTS. The rectangle is merged with every one whose union
+ * with it is not larger than the two together, as when they overlap or
+ * are adjacent along a side. Returns the new number of rectangles.
+ */
+static int add_dirty_rect(GAL_Rect *rcs, int nr_rcs, GAL_Rect rc)
+{
+    int i, j, best_i, best_j;
+    int64_t waste, least;
+
+again:
+    for (i = 0; i < nr_rcs; i++) {
+        GAL_Rect u = rect_union(rcs + i, &rc);
+
+        if (rect_area(&u) <= rect_area(rcs + i) + rect_area(&rc)) {
+            rc = u;
+            rcs[i] = rcs[--nr_rcs];
+            goto again;
+        }
+    }
+
+    rcs[nr_rcs++] = rc;
+    if (nr_rcs <= RGA_PRESENT_MAX_RECTS)
+        return nr_rcs;
+
+    least = INT64_MAX;
+    best_i = 0;
+    best_j = 1;
+    for (i = 0; i < nr_rcs; i++) {
+        for (j = i + 1; j < nr_rcs; j++) {
+            GAL_Rect u = rect_union(rcs + i, rcs + j);
+
+            waste = rect_area(&u) - rect_area(rcs + i) - rect_area(rcs + j);
+            if (waste < least) {
+                least = waste;
+                best_i = i;
+                best_j = j;
+            }
+        }
+    }
+
+    rc = rect_union(rcs + best_i, rcs + best_j);
+    rcs[best_j] = rcs[--nr_rcs];
+    rcs[best_i] = rcs[--nr_rcs];
+    goto again;
+}
+
+/* Map a rectangle of the shadow surface, width x height, to the scanout
+   surface, which is the shadow surface rotated clockwise. */
+static GAL_Rect rotate_rect(const GAL_Rect *rc, int width, int height,
+        int rotation)
+{
+    GAL_Rect r;
+
+    switch (rotation) {
+        case HBDDRM_ROTATE_90:
+            r.x = height - rc->y - rc->h;
+            r.y = rc->x;
+            r.w = rc->h;
+            r.h = rc->w;
             break;
-        case COLOR_BLEND_PD_XOR:
-            usage |= IM_ALPHA_BLEND_XOR;
+
+        case HBDDRM_ROTATE_180:
+            r.x = width - rc->x - rc->w;
+            r.y = height - rc->y - rc->h;
+            r.w = rc->w;
+            r.h = rc->h;
             break;
+
         default:
-            return -1;
+            r.x = rc->y;
+            r.y = width - rc->x - rc->w;
+            r.w = rc->h;
+            r.h = rc->w;
+            break;
     }
 
-    int rop_code = 0;
-    switch (ops->rop) {
-        case COLOR_LOGICOP_COPY:
-            break;
-        case COLOR_LOGICOP_AND:
-            usage |= IM_ROP;
-            rop_code = IM_ROP_AND;
+    return r;
+}
+
+/*
+ * Copy the dirty rectangles of the shadow surface to the rotated scanout
+ * surface. The rectangles are merged, and submitted in one RGA job: the
+ * pending job if any, which is ended as a present ends a frame. A dithered
+ * copy cannot be a task of a job, so the rectangles are submitted as the
+ * bands of a blit are then.
+ */
+static int present_rotated(DrmDriver *drv,
+        DrmSurfaceBuffer *shadow_buf, DrmSurfaceBuffer *scanout_buf,
+        const GAL_Rect *rcs, int nr_rcs, int rotation)
+{
+    my_surface_buffer *shadow = (my_surface_buffer *)shadow_buf;
+    my_surface_buffer *scanout = (my_surface_buffer *)scanout_buf;
+    GAL_Rect dirty[RGA_PRESENT_MAX_RECTS + 1];
+    struct rga_job jobs[RGA_PRESENT_MAX_RECTS];
+    int width = shadow->base.width, height = shadow->base.height;
+    int usage, nr_dirty = 0, i;
+
+    switch (rotation) {
+        case HBDDRM_ROTATE_90:
+            usage = IM_HAL_TRANSFORM_ROT_90;
             break;
-        case COLOR_LOGICOP_OR:
-            usage |= IM_ROP;
-            rop_code = IM_ROP_OR;
+        case HBDDRM_ROTATE_180:
+            usage = IM_HAL_TRANSFORM_ROT_180;
             break;
-        case COLOR_LOGICOP_XOR:
-            usage |= IM_ROP;
-            rop_code = IM_ROP_XOR;
+        case HBDDRM_ROTATE_270:
+            usage = IM_HAL_TRANSFORM_ROT_270;
             break;
-
-        case COLOR_LOGICOP_CLEAR:
-        case COLOR_LOGICOP_NOR:
-        case COLOR_LOGICOP_AND_INVERTED:
-        case COLOR_LOGICOP_AND_REVERSE:
-        case COLOR_LOGICOP_COPY_INVERTED:
-        case COLOR_LOGICOP_INVERT:
-        case COLOR_LOGICOP_NAND:
-        case COLOR_LOGICOP_EQUIV:
-        case COLOR_LOGICOP_NOOP0:
-        case COLOR_LOGICOP_OR_INVERTED1:
-        case COLOR_LOGICOP_OR_REVERSE:
-        case COLOR_LOGICOP_SET:
         default:
             return -1;
     }
 
-    if (opt && usage & IM_ROP) {
-        opt->rop_code = rop_code;
-    }
-
-    if (ops->scl != SCALING_FILTER_FAST) {
+    if (rotation == HBDDRM_ROTATE_180 ?
+            (scanout->base.width != shadow->base.width ||
+             scanout->base.height != shadow->base.height) :
+            (scanout->base.width != shadow->base.height ||
+             scanout->base.height != shadow->base.width)) {
+        _DBG_PRINTF("DRM>ROCKCHIP: the scanout surface is not the shadow "
+                "surface rotated\n");
         return -1;
     }
 
-    return usage | IM_SYNC;
-}
+    if (is_yuv_format(scanout->rk_format))
+        return fall_back(drv, HBDDRM_FALLBACK_FORMAT);
 
+    if (!import_rga_buffer(drv, shadow) || !import_rga_buffer(drv, scanout))
+        return fall_back(drv, HBDDRM_FALLBACK_IMPORT);
 
-static int rockchip_blitter(DrmDriver *drv,
-        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
-        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
-        const DrmBlitOperations *ops)
-{
-    (void)drv;
-    my_surface_buffer *src = (my_surface_buffer *)src_buf;
-    my_surface_buffer *dst = (my_surface_buffer *)dst_buf;
+    for (i = 0; i < nr_rcs; i++) {
+        GAL_Rect rc;
+
+        rc.x = MAX(rcs[i].x, 0);
+        rc.y = MAX(rcs[i].y, 0);
+        rc.w = MIN(rcs[i].x + rcs[i].w, width) - rc.x;
+        rc.h = MIN(rcs[i].y + rcs[i].h, height) - rc.y;
+        if (rc.w > 0 && rc.h > 0)
+            nr_dirty = add_dirty_rect(dirty, nr_dirty, rc);
+    }
 
-    im_rect src_imrc = { src_rc->x, src_rc->y + src->nr_hdr_lines,
-        src_rc->w, src_rc->h };
-    im_rect dst_imrc = { dst_rc->x, dst_rc->y + src->nr_hdr_lines,
-        dst_rc->w, dst_rc->h };
+    if (nr_dirty == 0)
+        return 0;
+
+    shadow->rga_buffer.global_alpha = -1;
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < nr_dirty; i++) {
+        GAL_Rect rc = rotate_rect(dirty + i, width, height, rotation);
+
+        jobs[i].src = shadow->rga_buffer;
+        jobs[i].dst = scanout->rga_buffer;
+        jobs[i].src_rect = to_imrect(shadow, dirty + i);
+        jobs[i].dst_rect = to_imrect(scanout, &rc);
+        jobs[i].usage = usage;
+        jobs[i].dither = use_dither(drv, shadow, scanout,
+                &jobs[i].opt, usage);
+
+        if ((shadow->afbc || scanout->afbc) &&
+                !check_afbc(shadow, &jobs[i].src_rect,
+                    scanout, &jobs[i].dst_rect, usage))
+            return fall_back(drv, HBDDRM_FALLBACK_FORMAT);
+
+        if (!check_rga(drv, &jobs[i].src, &jobs[i].src_rect, NULL, NULL,
+                    &jobs[i].dst, &jobs[i].dst_rect, usage))
+            return fall_back_check(drv);
+
+        /* a rotation is not split into bands, so only the core is set */
+        schedule_job(drv, jobs + i);
+    }
 
-    im_opt_t opt = { };
-    int usage = get_usage_opt(ops, &opt);
-    assert(usage != -1);
+#ifdef RGA_HAVE_JOB_API
+    if (drv->executor == NULL && !jobs[0].dither) {
+        if (reserve_job(drv, 2, nr_dirty) == 0) {
+            add_job_buffer(drv, scanout);
+            add_job_buffer(drv, shadow);
+            count_jobs(drv, shadow, NULL, scanout, jobs, nr_dirty);
 
-    IM_STATUS status;
-#ifdef _DEBUG
-    status = imcheck(src->rga_buffer, dst->rga_buffer,
-            src_imrc, dst_imrc, usage);
-    if (status) {
-        _WRN_PRINTF("Failed imcheck(): %s\n", imStrError(status));
-        return -1;
+            int ret = add_job_tasks(drv, jobs, nr_dirty);
+            end_job(drv);
+            return ret;
+        }
     }
 #endif
 
-    rga_buffer_t dummy_rga = {};
-    im_rect dummy_imrc = {};
+    return rga_submit(drv, shadow, NULL, scanout, jobs, nr_dirty);
+}
 
-    if (ops->alf == BLIT_ALPHA_SET) {
-        src->rga_buffer.global_alpha = ops->alpha;
-    }
-    else {
-        src->rga_buffer.global_alpha = -1;
+/* Get the next surface for a mask blit, which has width x height pixels at
+   least; it is not used by RGA any more. */
+/*
+ * Take the room for a mask in the surfaces the masks are expanded into. It
+ * is taken in rows, in one surface after another, and no room is reused
+ * before flush_driver waits for the jobs reading it; so a mask blit neither
+ * waits for the previous ones, nor submits the pending job. Only if the
+ * masks of a frame fill all the surfaces is a surface waited for and reused.
+ */
+static my_surface_buffer *get_mask_buffer(DrmDriver *drv,
+        int width, int height, GAL_Rect *rc)
+{
+    my_surface_buffer **buf = drv->mask_bufs + drv->cur_mask_buf;
+    int w = ROUND_TO_MULTIPLE(width, 16), h = ROUND_TO_MULTIPLE(height, 2);
+
+    if (*buf && drv->mask_x + w > (int)(*buf)->base.width) {
+        drv->mask_x = 0;
+        drv->mask_y += drv->mask_row_height;
+        drv->mask_row_height = 0;
     }
 
-    status= improcess(src->rga_buffer, dst->rga_buffer, dummy_rga,
-            dst_imrc, src_imrc, dummy_imrc, &opt, usage);
-    if (status) {
-        _WRN_PRINTF("Failed improcess(): %s\n", imStrError(status));
-        return -1;
+    if (*buf == NULL || drv->mask_x + w > (int)(*buf)->base.width ||
+            drv->mask_y + h > (int)(*buf)->base.height) {
+        if (*buf) {
+            drv->cur_mask_buf = (drv->cur_mask_buf + 1) % RK_MASK_BUFS;
+            drv->nr_mask_bufs_filled++;
+            buf = drv->mask_bufs + drv->cur_mask_buf;
+        }
+        drv->mask_x = 0;
+        drv->mask_y = 0;
+        drv->mask_row_height = 0;
+
+        if (*buf && ((int)(*buf)->base.width < w ||
+                    (int)(*buf)->base.height < h)) {
+            rockchip_destroy_buffer(drv, &(*buf)->base);
+            *buf = NULL;
+        }
+
+        if (*buf == NULL) {
+            *buf = (my_surface_buffer *)rockchip_alloc_buffer(drv,
+                    DRM_FORMAT_ARGB8888, 0,
+                    ROUND_TO_MULTIPLE(MAX(w, RK_MASK_BUF_SIZE), 64),
+                    ROUND_TO_MULTIPLE(MAX(h, RK_MASK_BUF_SIZE), 16),
+                    DRM_SURBUF_TYPE_OFFSCREEN);
+            if (*buf == NULL)
+                return NULL;
+        }
+        else if (drv->nr_mask_bufs_filled >= RK_MASK_BUFS) {
+            /* used in this frame already */
+            sync_buffer(drv, *buf);
+        }
     }
 
-    return 0;
+    rc->x = drv->mask_x;
+    rc->y = drv->mask_y;
+    rc->w = width;
+    rc->h = height;
+    drv->mask_x += w;
+    drv->mask_row_height = MAX(drv->mask_row_height, h);
+    return *buf;
 }
 
-static CB_DRM_BLIT rockchip_check_blit(DrmDriver *drv,
-        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
-        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
-        const DrmBlitOperations *ops)
+/*
+ * Blend through a coverage mask with RGA: the color, or the source copied
+ * by RGA, is put in an ARGB8888 surface with the mask as the alpha, and RGA
+ * blends it over dst. The CPU only writes the small surface, which is
+ * cacheable, and never reads dst, which may be write-combined. A solid
+ * color is taken for a destination in ARGB8888 or XRGB8888 only.
+ */
+static int mask_blit(DrmDriver *drv,
+        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc, uint32_t pixel,
+        const uint8_t *mask, int mask_pitch,
+        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc)
 {
-    (void)drv;
     my_surface_buffer *src = (my_surface_buffer *)src_buf;
     my_surface_buffer *dst = (my_surface_buffer *)dst_buf;
+    my_surface_buffer *tmp;
+    GAL_Rect tmp_rc;
+    im_opt_t opt = { };
+    uint8_t *pixels;
+    size_t pitch;
+    int x, y;
 
-    im_rect src_imrc = { src_rc->x, src_rc->y + src->nr_hdr_lines,
-        src_rc->w, src_rc->h };
-    im_rect dst_imrc = { dst_rc->x, dst_rc->y + src->nr_hdr_lines,
-        dst_rc->w, dst_rc->h };
+    if (is_yuv_format(dst->rk_format) || dst->afbc ||
+            (src && (is_yuv_format(src->rk_format) || src->afbc)))
+        return fall_back(drv, HBDDRM_FALLBACK_FORMAT);
 
-    im_opt_t opt = { };
-    int usage = get_usage_opt(ops, &opt);
-    assert(usage != -1);
+    if (src == NULL && dst->base.drm_format != DRM_FORMAT_ARGB8888 &&
+            dst->base.drm_format != DRM_FORMAT_XRGB8888)
+        return fall_back(drv, HBDDRM_FALLBACK_FORMAT);
 
-    IM_STATUS status;
-    status = imcheck(src->rga_buffer, dst->rga_buffer,
-            src_imrc, dst_imrc, usage);
-    if (status) {
-        _WRN_PRINTF("Failed imcheck(): %s\n", imStrError(status));
-        return NULL;
-    }
+    if (!import_rga_buffer(drv, dst) ||
+            (src && !import_rga_buffer(drv, src)))
+        return fall_back(drv, HBDDRM_FALLBACK_IMPORT);
 
-    return rockchip_blitter;
-}
+    tmp = get_mask_buffer(drv, dst_rc->w, dst_rc->h, &tmp_rc);
+    if (tmp == NULL || !import_rga_buffer(drv, tmp))
+        return fall_back(drv, HBDDRM_FALLBACK_IMPORT);
 
-static int rockchip_copy_buff(DrmDriver *drv,
-        DrmSurfaceBuffer *src_buf, const GAL_Rect *src_rc,
-        DrmSurfaceBuffer *dst_buf, const GAL_Rect *dst_rc,
-        BlitCopyOperation op)
-{
-    (void)drv;
-    my_surface_buffer *src = (my_surface_buffer *)src_buf;
-    my_surface_buffer *dst = (my_surface_buffer *)dst_buf;
+    im_rect tmp_imrc = to_imrect(tmp, &tmp_rc);
+    im_rect dst_imrc = to_imrect(dst, dst_rc);
+    if (!check_rga(drv, &tmp->rga_buffer, &tmp_imrc, NULL, NULL,
+                &dst->rga_buffer, &dst_imrc, IM_ALPHA_BLEND_SRC_OVER))
+        return fall_back_check(drv);
 
-    if (src->rga_handle == 0 || dst->rga_handle == 0) {
-        return -1;
-    }
+    if (src) {
+        im_rect src_imrc = to_imrect(src, src_rc);
 
-    int usage = IM_SYNC;
-    im_rect src_imrc = {
-        src_rc->x, src_rc->y + src->nr_hdr_lines, src_rc->w, src_rc->h };
-    im_rect dst_imrc = {
-        dst_rc->x, dst_rc->y + src->nr_hdr_lines, dst_rc->w, dst_rc->h };
+        if (!check_rga(drv, &src->rga_buffer, &src_imrc, NULL, NULL,
+                    &tmp->rga_buffer, &tmp_imrc, 0))
+            return fall_back_check(drv);
 
-    switch (op) {
-        case BLIT_COPY_TRANSLATE:
-            break;
+        src->rga_buffer.global_alpha = -1;
+        if (rga_process(drv, src, src_imrc, tmp, tmp_imrc, &opt, 0))
+            return -1;
+        sync_buffer(drv, tmp);
+    }
 
-        case BLIT_COPY_ROT_90:
-            usage |= IM_HAL_TRANSFORM_ROT_90;
-            break;
+    pixels = get_mapping(drv, tmp);
+    if (pixels == NULL)
+        return -1;
 
-        case BLIT_COPY_ROT_180:
-            usage |= IM_HAL_TRANSFORM_ROT_180;
-            break;
+    sync_cpu_access(drv, tmp, DMA_BUF_SYNC_START);
+    pitch = tmp->rga_buffer.wstride * tmp->base.cpp;
+    pixels += tmp_imrc.y * pitch + tmp_imrc.x * tmp->base.cpp;
+    for (y = 0; y < dst_rc->h; y++) {
+        uint32_t *row = (uint32_t *)(pixels + y * pitch);
+        const uint8_t *m = mask + y * mask_pitch;
 
-        case BLIT_COPY_ROT_270:
-            usage |= IM_HAL_TRANSFORM_ROT_270;
-            break;
+        for (x = 0; x < dst_rc->w; x++)
+            row[x] = ((src ? row[x] : pixel) & 0x00FFFFFF) |
+                (uint32_t)m[x] << 24;
+    }
+    sync_cpu_access(drv, tmp, DMA_BUF_SYNC_END);
 
-        case BLIT_COPY_FLIP_H:
-            usage |= IM_HAL_TRANSFORM_FLIP_H;
-            break;
+    tmp->rga_buffer.global_alpha = -1;
+    return rga_process(drv, tmp, tmp_imrc, dst, dst_imrc, &opt,
+            IM_ALPHA_BLEND_SRC_OVER);
+}
 
-        case BLIT_COPY_FLIP_V:
-            usage |= IM_HAL_TRANSFORM_FLIP_V;
-            break;
+/* Wait for all RGA jobs submitted. */
+static void rockchip_flush_driver(DrmDriver *drv)
+{
+    if (drv->executor)
+        drm_executor_drain(drv->executor);
+#ifdef RGA_HAVE_JOB_API
+    end_job(drv);
+#endif
+    wait_fence(&drv->fence);
+    report_failures(drv, false);
+
+    /* the room in the mask surfaces is free again */
+    drv->nr_mask_bufs_filled = 0;
+    drv->mask_x = 0;
+    drv->mask_y = 0;
+    drv->mask_row_height = 0;
+}
 
-        case BLIT_COPY_FLIP_H_V:
-            usage |= IM_HAL_TRANSFORM_FLIP_H_V;
-            break;
+static int get_hw_stats(DrmDriver *drv, HbdDrmHwStats *stats, bool reset)
+{
+    if (drv->executor)
+        drm_executor_drain(drv->executor);
+
+    *stats = drv->stats;
+    stats->nr_timed_jobs = atomic_load(&drv->exec_timed_jobs);
+    stats->hw_time_ns = atomic_load(&drv->exec_time_ns);
+    stats->nr_failures = get_nr_failures(drv);
+
+    if (reset) {
+        memset(&drv->stats, 0, sizeof(drv->stats));
+        atomic_store(&drv->exec_timed_jobs, 0);
+        atomic_store(&drv->exec_time_ns, 0);
+        atomic_store(&drv->exec_failures, 0);
+        drv->reported_failures = 0;
+        drv->reported_fallbacks = 0;
     }
 
-    IM_STATUS status;
-    status = imcheck(src->rga_buffer, dst->rga_buffer,
-            src_imrc, dst_imrc, usage);
-    if (status) {
-        _DBG_PRINTF("Failed imcheck(%d): %s\n", op, imStrError(status));
-        return -1;
+    return 0;
+}
+
+static int dump_stats(DrmDriver *drv, FILE *fp)
+{
+    static const char *op_names[HBDDRM_NR_OPS] = {
+        "fill", "copy", "scale", "rotate", "blend", "rop", "composite",
+        "dither",
+    };
+    static const char *fallback_names[HBDDRM_NR_FALLBACKS] = {
+        "format", "import", "operation", "check",
+    };
+    HbdDrmHwStats stats;
+    int i;
+
+    get_hw_stats(drv, &stats, false);
+
+    fprintf(fp, "DRM>ROCKCHIP: operations:");
+    for (i = 0; i < HBDDRM_NR_OPS; i++)
+        fprintf(fp, " %s %llu", op_names[i],
+                (unsigned long long)stats.nr_ops[i]);
+    fprintf(fp, "\nDRM>ROCKCHIP: jobs %llu, bytes %llu, failed %llu\n",
+            (unsigned long long)stats.nr_jobs,
+            (unsigned long long)stats.nr_bytes,
+            (unsigned long long)stats.nr_failures);
+    if (stats.nr_timed_jobs) {
+        fprintf(fp, "DRM>ROCKCHIP: timed jobs %llu, %.3f ms, %.1f us per job\n",
+                (unsigned long long)stats.nr_timed_jobs,
+                stats.hw_time_ns / 1e6,
+                stats.hw_time_ns / 1e3 / stats.nr_timed_jobs);
     }
 
-    rga_buffer_t dummy_rga = {};
-    im_rect dummy_imrc = {};
-    im_opt_t dummy_opt = {};
-    status= improcess(src->rga_buffer, dst->rga_buffer, dummy_rga,
-            dst_imrc, src_imrc, dummy_imrc, &dummy_opt, usage);
-    if (status) {
-        _WRN_PRINTF("Failed improcess(): %s\n", imStrError(status));
-        return -1;
+    fprintf(fp, "DRM>ROCKCHIP: refused by imcheck():");
+    for (i = 0; i < HBDDRM_NR_CHECK_STATUS; i++) {
+        if (stats.nr_rejects[i])
+            fprintf(fp, " %s %llu", i < HBDDRM_NR_CHECK_STATUS - 1 ?
+                    imStrError((IM_STATUS)-i) : "other",
+                    (unsigned long long)stats.nr_rejects[i]);
     }
 
+    fprintf(fp, "\nDRM>ROCKCHIP: left to the CPU:");
+    for (i = 0; i < HBDDRM_NR_FALLBACKS; i++)
+        fprintf(fp, " %s %llu", fallback_names[i],
+                (unsigned long long)stats.nr_fallbacks[i]);
+    fprintf(fp, "\n");
     return 0;
 }
 
@@ -979,7 +4243,7 @@ DrmDriverOps* _drm_device_get_rockchip_driver(int device_fd)
     static DrmDriverOps rockchip_driver = {
         .create_driver = rockchip_create_driver,
         .destroy_driver = rockchip_destroy_driver,
-        .flush_driver = NULL,
+        .flush_driver = rockchip_flush_driver,
         .create_buffer = rockchip_create_buffer,
         .create_buffer_from_handle = rockchip_create_buffer_from_handle,
         .create_buffer_from_name = rockchip_create_buffer_from_name,
@@ -53,6 +53,8 @@
 
 #include "libdrm-macros.h"
 #include "helpers.h"
+#include "atlas.h"
+#include "drivers.h"
 
 struct vmwgfx_buffer
 {
@@ -60,12 +62,41 @@ struct vmwgfx_buffer
     off_t map_offset;
     uint64_t map_handle;
     unsigned map_count;
+    DrmAtlasSlot slot;
 };
 
 /* the driver data struct */
 struct _DrmDriver {
     int         fd;
     unsigned    nr_bufs;
+    DrmAtlas    *atlas;
+};
+
+static DrmSurfaceBuffer* vmwgfx_alloc_buffer (DrmDriver *driver,
+        uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t flags);
+static void vmwgfx_destroy_buffer(DrmDriver *driver, DrmSurfaceBuffer* buffer);
+static uint8_t* vmwgfx_map_buffer(DrmDriver *driver,
+        DrmSurfaceBuffer* buffer);
+static void vmwgfx_unmap_buffer(DrmDriver *driver,
+        DrmSurfaceBuffer* buffer);
+
+static DrmSurfaceBuffer* vmwgfx_create_atlas_page (DrmDriver *driver,
+        uint32_t drm_format, uint32_t width, uint32_t height)
+{
+    return vmwgfx_alloc_buffer(driver, drm_format, 0, width, height,
+            DRM_SURBUF_TYPE_OFFSCREEN);
+}
+
+static const DrmAtlasOps vmwgfx_atlas_ops = {
+    .create_page = vmwgfx_create_atlas_page,
+    .destroy_page = vmwgfx_destroy_buffer,
+};
+
+/* For the CPU paths of the extra interfaces. */
+static const DrmDriverExtOps vmwgfx_ext_ops = {
+    .map_buffer = vmwgfx_map_buffer,
+    .unmap_buffer = vmwgfx_unmap_buffer,
 };
 
 static DrmDriver* vmwgfx_create_driver(int device_fd)
@@ -75,7 +106,9 @@ static DrmDriver* vmwgfx_create_driver(int device_fd)
     driver = calloc(1, sizeof(DrmDriver));
     driver->fd = device_fd;
     driver->nr_bufs = 0;
+    driver->atlas = drm_atlas_new(driver, &vmwgfx_atlas_ops);
 
+    drm_driver_register(driver, device_fd, &vmwgfx_ext_ops);
     _DBG_PRINTF ("Driver %p created\n", driver);
     return driver;
 }
@@ -83,6 +116,9 @@ static DrmDriver* vmwgfx_create_driver(int device_fd)
 static void
 vmwgfx_destroy_driver(DrmDriver *driver)
 {
+    drm_driver_unregister(driver);
+    drm_atlas_delete(driver->atlas);
+
     if (driver->nr_bufs) {
         _WRN_PRINTF ("There is still %d buffers left\n", driver->nr_bufs);
     }
@@ -92,7 +128,45 @@ vmwgfx_destroy_driver(DrmDriver *driver)
     _DBG_PRINTF ("Driver %p destroyed\n", driver);
 }
 
-static DrmSurfaceBuffer* vmwgfx_create_buffer (DrmDriver *driver,
+/* A surface in an atlas page shares the DMA buffer of the page. */
+static struct vmwgfx_buffer* vmwgfx_create_buffer_from_atlas (
+        DrmDriver *driver, uint32_t drm_format, int bpp, int cpp,
+        uint32_t width, uint32_t height)
+{
+    struct vmwgfx_buffer *bo, *page;
+    DrmAtlasSlot slot;
+
+    if (drm_atlas_alloc(driver->atlas, drm_format, width, height, &slot))
+        return NULL;
+
+    bo = calloc(1, sizeof(*bo));
+    if (!bo) {
+        drm_atlas_free(driver->atlas, &slot);
+        return NULL;
+    }
+
+    page = (struct vmwgfx_buffer *)slot.page_buf;
+    bo->base = page->base;
+    bo->base.bpp = bpp;
+    bo->base.cpp = cpp;
+    bo->base.width = width;
+    bo->base.height = height;
+    bo->base.offset = slot.y * page->base.pitch + slot.x * cpp;
+    bo->base.buff = NULL;
+    bo->map_handle = page->map_handle;
+    bo->map_offset = page->map_offset;
+    bo->slot = slot;
+
+    _DBG_PRINTF ("Allocate surface in atlas page (0x%x): "
+            "width (%d), height (%d), (pitch: %d), offset (%ld)\n",
+            bo->base.handle, bo->base.width, bo->base.height,
+            bo->base.pitch, (long)bo->base.offset);
+
+    driver->nr_bufs++;
+    return bo;
+}
+
+static DrmSurfaceBuffer* vmwgfx_alloc_buffer (DrmDriver *driver,
         uint32_t drm_format, uint32_t hdr_size,
         uint32_t width, uint32_t height, uint32_t flags)
 {
@@ -104,6 +178,14 @@ static DrmSurfaceBuffer* vmwgfx_create_buffer (DrmDriver *driver,
         return NULL;
     }
 
+    if (driver->atlas &&
+            IS_SURFACE_FOR_ATLAS(hdr_size, width, height, flags)) {
+        struct vmwgfx_buffer *bo = vmwgfx_create_buffer_from_atlas (driver,
+                drm_format, bpp, cpp, width, height);
+        if (bo)
+            return &bo->base;
+    }
+
     pitch = ROUND_TO_MULTIPLE (width * cpp, 4);
     if (hdr_size) {
         nr_hdr_lines = hdr_size / pitch;
@@ -170,6 +252,40 @@ error:
 extern void *mmap64(void *addr, size_t len, int prot, int flags,
         int fildes, uint64_t off);
 
+/* There is no fill on this device; clear a new surface with the CPU
+   through a temporary mapping, using the streaming stores. */
+static void vmwgfx_clear_buffer (DrmDriver *driver,
+        struct vmwgfx_buffer *bo, uint32_t pixel)
+{
+    uint8_t *map = mmap64(NULL, bo->base.size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, driver->fd,
+            bo->map_handle);
+    if (map == NULL || map == MAP_FAILED) {
+        _WRN_PRINTF ("Failed mmap(): %m; the surface is not cleared\n");
+        return;
+    }
+
+    drm_fill_pixels(map + bo->base.offset, bo->base.pitch, bo->base.cpp,
+            bo->base.width, bo->base.height, pixel);
+    drm_munmap(map, bo->base.size);
+}
+
+static DrmSurfaceBuffer* vmwgfx_create_buffer (DrmDriver *driver,
+        uint32_t drm_format, uint32_t hdr_size,
+        uint32_t width, uint32_t height, uint32_t flags)
+{
+    DrmSurfaceBuffer *buffer;
+    uint32_t pixel;
+
+    buffer = vmwgfx_alloc_buffer(driver, drm_format, hdr_size,
+            width, height, flags);
+    if (buffer && drm_driver_clear_on_create(driver, flags, &pixel)) {
+        vmwgfx_clear_buffer(driver, (struct vmwgfx_buffer *)buffer, pixel);
+    }
+
+    return buffer;
+}
+
 static uint8_t* vmwgfx_map_buffer(DrmDriver *driver,
         DrmSurfaceBuffer* buffer)
 {
@@ -215,6 +331,13 @@ static void vmwgfx_destroy_buffer(DrmDriver *driver, DrmSurfaceBuffer* buffer)
         bo->base.buff = NULL;
     }
 
+    if (bo->slot.page) {
+        drm_atlas_free(driver->atlas, &bo->slot);
+        driver->nr_bufs--;
+        free(bo);
+        return;
+    }
+
     memset(&arg, 0, sizeof(arg));
     arg.handle = bo->base.handle;
     drmCommandWrite(driver->fd, DRM_VMW_UNREF_DMABUF, &arg, sizeof(arg));